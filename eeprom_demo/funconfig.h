@@ -3,5 +3,13 @@
 
 #define CH32V003           1
 
+/* Calibrate the eeprom's bus clock on the first boot, and keep the result
+   in the eeprom for the boots after it */
+//#define I2C_USE_SPEEDS
+
+/* Also write through the write-behind queue, and count the main loop
+   passes it leaves free */
+//#define EEP_USE_QUEUE
+
 #endif
 
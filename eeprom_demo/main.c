@@ -72,10 +72,10 @@ void test(void){
     ret=eep_write(0x10, buf3, 32);
     test_buf_print(buf3,64);
     printf(" ret, should be 0, %d\n",ret);
-    /* not on a boundary and data wont fit, return 253 */
+    /* not on a boundary and data wont fit, split over two pages */
     printf(" page write\n");
     ret=eep_write(0x32, buf3, 64);
-    printf(" ret, should be 253, %d\n",ret);
+    printf(" ret, should be 0, %d\n",ret);
     test_buf_print(buf3,64);
     printf("\n");
 
@@ -96,7 +96,8 @@ void test(void){
     printf("\n");
     memset(buf64,9,64);
 
-    /* write a page of sequential data, but not on a boundary */
+    /* write a page of sequential data, but not on a boundary.  The
+       first 8 bytes stay 1, the data runs on into the next page */
     memset(buf64,1,64);
     ret=eep_write(0x0, buf64, 64);
     printf("  write returned, %d.\n",ret);
@@ -112,11 +113,124 @@ void test(void){
     printf("page read, if any of these are A, theres a problem.\n");
     eep_read(0x0, buf64, 64);
     test_buf_print(buf64,64);
+    eep_read(0x40, buf64, 8);
+    test_buf_print(buf64,8);
     printf("\n");
     memset(buf64,9,64);
 
 }
 
+/* Write 256 bytes at an odd offset, so it is split into 5 pages, and time it.
+   Each page is a 67 byte write (9 bits a byte) plus the write cycle, which
+   is 5ms at worst and usually less, ACK polling picks up the real end */
+void throughput(void){
+    static uint8_t big[256];
+    uint16_t k;
+    uint8_t ret;
+
+    for (k=0; k<sizeof(big); k++) big[k]=k;
+
+    uint32_t start = SysTick->CNT;
+    ret = eep_write(0x1020, big, sizeof(big));
+    if (ret == 0) ret = eep_wait_ready();
+    uint32_t us = (SysTick->CNT - start) / DELAY_US_TIME;
+
+    printf("256 byte write, ret %d, %lu us, %lu bytes/s\n", ret, us,
+           us ? sizeof(big) * 1000000UL / us : 0);
+
+    memset(big, 0, sizeof(big));
+    ret = eep_read(0x1020, big, sizeof(big));
+    for (k=0; k<sizeof(big) && big[k]==(uint8_t)k; k++);
+    printf("256 byte read back, ret %d, %s\n", ret, k==sizeof(big) ? "ok" : "MISMATCH");
+}
+
+
+/* Add up every byte that streams past, and count them */
+uint32_t dump_sum, dump_bytes;
+uint8_t dump_chunk(i2c_xfer_t *xfer, const uint8_t *buf, const uint16_t len){
+    for (uint16_t k=0; k<len; k++) dump_sum += buf[k];
+    dump_bytes += len;
+    return 1;
+}
+
+/* Read the whole eeprom in one transfer, through a 32 byte buffer.  At
+   400KHz a byte is 9 clocks, so the bus limit is about 44000 bytes/s */
+void dump(void){
+    uint8_t chunk[32];
+    dump_sum = 0;
+    dump_bytes = 0;
+
+    uint32_t start = SysTick->CNT;
+    uint8_t ret = eep_stream(0x0, EEP_SIZE, chunk, sizeof(chunk), dump_chunk);
+    uint32_t us = (SysTick->CNT - start) / DELAY_US_TIME;
+
+    printf("32KB dump, ret %d, %lu bytes, sum 0x%08lx, %lu us, %lu bytes/s\n",
+           ret, dump_bytes, dump_sum, us, us >= 1000 ? dump_bytes * 1000UL / (us / 1000) : 0);
+}
+
+#ifdef EEP_USE_QUEUE
+/* Queue the same 256 bytes behind the CPU's back.  eep_enqueue returns at
+   once while there is room, and the main loop counts how much work it gets done while
+   eep_step moves the pages out and waits on the write cycles */
+void write_behind(void){
+    static uint8_t big[256];
+    uint32_t work = 0, pages;
+    uint16_t k;
+    uint8_t ret, max;
+
+    for (k=0; k<sizeof(big); k++) big[k]=~k;
+
+    /* queued a record at a time, a full queue is moved on and tried again */
+    uint32_t start = SysTick->CNT;
+    for (k=0; k<sizeof(big); k+=32){
+        while (eep_enqueue(0x1020 + k, &big[k], 32) == 252) {
+            eep_step();
+            work++;
+        }
+    }
+    uint32_t queued = (SysTick->CNT - start) / DELAY_US_TIME;
+    printf("256 byte enqueue, %lu us\n", queued);
+
+    /* stands in for the real main loop */
+    while (eep_step()) work++;
+    uint32_t us = (SysTick->CNT - start) / DELAY_US_TIME;
+
+    ret = eep_flush();
+    eep_queue_depth(&max, &pages);
+    printf("written behind in %lu us, %lu loop passes free, queue max %d, "
+           "pages %lu, ret %d\n", us, work, max, pages, ret);
+
+    memset(big, 0, sizeof(big));
+    ret = eep_read(0x1020, big, sizeof(big));
+    for (k=0; k<sizeof(big) && big[k]==(uint8_t)~k; k++);
+    printf("256 byte read back, ret %d, %s\n", ret, k==sizeof(big) ? "ok" : "MISMATCH");
+}
+#endif
+
+
+#ifdef I2C_USE_SPEEDS
+/* Last page of a 24LC256, out of the way of the tests above */
+#define SPEEDS_PAGE 0x7FC0
+
+/* Use the speed table saved by an earlier boot.  If there is none, find
+   the fastest rate the eeprom works at on this board, reading back the
+   first 4 bytes 8 times at each rate, and save it for next time */
+void calibrate(void){
+    uint8_t probe_buf[4];
+    i2c_xfer_t probe = {.addr = I2C_ADDR, .reg_len = 2, .reg = {0x00, 0x00},
+                        .rbuf = probe_buf, .rlen = 4};
+
+    if (eep_load_speeds(SPEEDS_PAGE) == 0) {
+        printf("speed table loaded from the eeprom\n");
+        return;
+    }
+
+    uint32_t rate = i2c_calibrate(&probe, 8);
+    printf("eeprom calibrated to %lu Hz\n", rate);
+    if (eep_save_speeds(SPEEDS_PAGE) != 0) printf("failed to save the speed table\n");
+}
+#endif
+
 
 /* Lets test out some features. */
 int main()
@@ -130,18 +244,27 @@ int main()
 	   I2C_CLK_500KHZ   I2C_CLK_600KHZ   I2C_CLK_750KHZ    I2C_CLK_1MHZ  */
 	if(i2c_init(I2C_CLK_400KHZ) != I2C_OK) printf("Failed to init the I2C Bus\n");
 
-	/* Initialising I2C causes the pins to transition from LOW to HIGH.
-	   Wait 100ms to allow the I2C Device to timeout and ignore the transition.
+	/* Initialising I2C causes the pins to transition from LOW to HIGH, and a
+	   device may have been reset halfway through a transfer.  Clock out any
+	   half sent byte and send a STOP, so every device starts from idle.
 	   Otherwise, an extra 1-bit will be added to the next transmission */
-	Delay_Ms(100);
+	if(i2c_recover() != I2C_OK) printf("I2C Bus is held low\n");
 
 	/* Scan the I2C Bus, prints any devices that respond */
 	printf("----Scanning I2C Bus for Devices---\n");
 	i2c_scan(i2c_scan_callback);
 	printf("----Done Scanning----\n\n");
 
-	test();
+	#ifdef I2C_USE_SPEEDS
+	calibrate();
+	#endif
 
+	test();
+	throughput();
+	dump();
+#ifdef EEP_USE_QUEUE
+	write_behind();
+#endif
 
 	return(0);
 }
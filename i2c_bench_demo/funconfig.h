@@ -0,0 +1,29 @@
+#ifndef _FUNCONFIG_H
+#define _FUNCONFIG_H
+
+#define CH32V003           1
+
+/* Build once as-is, then again with this uncommented, and compare the
+   printed cycle counts. See README.md */
+//#define I2C_USE_DMA
+
+/* Also read the eeprom over a bit-banged bus at 1MHz */
+//#define I2C_USE_SOFT
+
+/* Per-device counters and latency histogram, printed after every run */
+//#define I2C_USE_STATS
+
+/* Also send an OLED refresh sleeping in WFI, and print the busy fraction */
+//#define I2C_USE_WFI
+
+/* Also send the OLED frame at 1MHz, with the eeprom kept at 400KHz */
+//#define I2C_USE_SPEEDS
+
+/* Also time OLED frames with a hardware PEC, and the same CRC in software */
+//#define I2C_USE_PEC
+
+/* Count the passes the CPU gets while DMA is moving a payload */
+#define I2C_DMA_WAIT_HOOK() (bench_idle_spins++)
+extern volatile unsigned long bench_idle_spins;
+
+#endif
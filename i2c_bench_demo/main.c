@@ -0,0 +1,300 @@
+/* I2C transfer benchmark for lib_i2c.
+
+   Times bulk transfers with SysTick and prints the cost in CPU cycles, so
+   the polled and DMA paths of lib_i2c can be compared on real hardware.
+
+   Devices used:
+     SSD1306 OLED at 0x3C   - 32 byte data packets, a full 128x64 frame
+     24LC256 eeprom at 0x52 - 64 byte page reads (nothing is written)
+                              and chained register snapshots
+
+   Build without, then with I2C_USE_DMA in funconfig.h and compare the
+   "cycles" columns. "idle" counts the passes through I2C_DMA_WAIT_HOOK,
+   ie how often the CPU was free to do other work during a transfer.
+*/
+
+#include "ch32fun.h"
+#include "lib_i2c.h"
+#include <stdio.h>
+
+#define OLED_ADDR    0x3C
+#define EEP_ADDR     0x52
+
+/* OLED frame of 1024 bytes is sent as 32 packets of 32 bytes */
+#define FRAME_PKTS   32
+#define PKT_SIZE     32
+#define PAGE_SIZE    64
+#define RUNS         8
+
+/* SysTick ticks to CPU cycles */
+#define TICKS_TO_CYCLES(t) ((t) * (FUNCONF_SYSTEM_CORE_CLOCK / 1000000) / DELAY_US_TIME)
+
+volatile unsigned long bench_idle_spins;
+
+#ifdef I2C_USE_SOFT
+/* Software bus on the hardware bus pins, so both run against the same eeprom */
+i2c_bus_t soft_bus = I2C_BUS_SOFT(GPIOC, RCC_APB2Periph_GPIOC, 2, 1, I2C_CLK_1MHZ);
+#endif
+
+uint8_t frame[PKT_SIZE];
+uint8_t page[PAGE_SIZE];
+
+/* Print one result line */
+void bench_report(const char *name, uint32_t ticks, uint32_t bytes, i2c_err_t err)
+{
+	printf("%s  bytes: %lu  cycles: %lu  cyc/byte: %lu  idle: %lu  err: %d\n",
+		name, bytes, TICKS_TO_CYCLES(ticks), TICKS_TO_CYCLES(ticks) / bytes,
+		bench_idle_spins, err);
+}
+
+/* Send a full OLED frame as 0x40 prefixed data packets */
+void bench_oled_frame(const char *name)
+{
+	i2c_err_t err = I2C_OK;
+	bench_idle_spins = 0;
+
+	uint32_t start = SysTick->CNT;
+	for(uint8_t run = 0; run < RUNS; run++)
+		for(uint8_t pkt = 0; pkt < FRAME_PKTS && err == I2C_OK; pkt++)
+			err = i2c_write(OLED_ADDR, 0x40, frame, PKT_SIZE);
+	uint32_t ticks = SysTick->CNT - start;
+
+	bench_report(name, ticks / RUNS, FRAME_PKTS * PKT_SIZE, err);
+}
+
+/* Same frame, with the control byte and data as two write segments */
+void bench_oled_frame_v(void)
+{
+	i2c_err_t err = I2C_OK;
+	bench_idle_spins = 0;
+
+	const uint8_t ctrl = 0x40;
+	const i2c_iovec_t pkt[2] = {{&ctrl, 1}, {frame, PKT_SIZE}};
+
+	uint32_t start = SysTick->CNT;
+	for(uint8_t run = 0; run < RUNS; run++)
+		for(uint8_t p = 0; p < FRAME_PKTS && err == I2C_OK; p++)
+			err = i2c_writev(OLED_ADDR, pkt, 2);
+	uint32_t ticks = SysTick->CNT - start;
+
+	bench_report("oled frame writev", ticks / RUNS, FRAME_PKTS * PKT_SIZE, err);
+}
+
+/* Read eeprom pages with 2 byte addressing */
+void bench_eep_read(const char *name)
+{
+	i2c_err_t err = I2C_OK;
+	bench_idle_spins = 0;
+
+	uint32_t start = SysTick->CNT;
+	for(uint8_t run = 0; run < RUNS && err == I2C_OK; run++)
+		err = i2c_read_2ba(EEP_ADDR, 0x00, 0x00, page, PAGE_SIZE);
+	uint32_t ticks = SysTick->CNT - start;
+
+	bench_report(name, ticks / RUNS, PAGE_SIZE, err);
+}
+
+#ifdef I2C_USE_WFI
+/* Full OLED refresh with the bus spinning, then sleeping in WFI. Cycles
+   asleep are the current draw proxy, the rest of the cycles the CPU was
+   awake. busy is the awake share of the refresh in percent */
+void bench_oled_sleep(void)
+{
+	i2c_bus_t *bus = i2c_bus_current();
+
+	for(uint8_t sleep = 0; sleep < 2; sleep++)
+	{
+		i2c_err_t err = I2C_OK;
+		bus->sleep = sleep;
+
+		uint32_t slept = i2c_sleep_ticks();
+		uint32_t start = SysTick->CNT;
+		for(uint8_t pkt = 0; pkt < FRAME_PKTS && err == I2C_OK; pkt++)
+			err = i2c_write(OLED_ADDR, 0x40, frame, PKT_SIZE);
+		uint32_t ticks = SysTick->CNT - start;
+		slept = i2c_sleep_ticks() - slept;
+
+		printf("oled refresh %s  awake: %lu  asleep: %lu  busy: %lu%%  err: %d\n",
+			sleep ? "wfi " : "spin", TICKS_TO_CYCLES(ticks - slept),
+			TICKS_TO_CYCLES(slept), (ticks - slept) * 100 / ticks, err);
+	}
+	bus->sleep = 0;
+}
+#endif
+
+#ifdef I2C_USE_SPEEDS
+/* Run the OLED at 1MHz while the eeprom stays at the bus clock. The frame
+   on its own, then every packet followed by an eeprom read, so the clock
+   changes twice per packet. Prints the reloads and their cost */
+void bench_speeds(void)
+{
+	uint32_t loads, ticks, start_loads, start_ticks;
+
+	i2c_set_speed(OLED_ADDR, I2C_CLK_1MHZ);
+	bench_oled_frame("oled frame 1MHz");
+
+	i2c_err_t err = I2C_OK;
+	start_loads = i2c_speed_switches(&start_ticks);
+	uint32_t start = SysTick->CNT;
+	for(uint8_t pkt = 0; pkt < FRAME_PKTS && err == I2C_OK; pkt++)
+	{
+		err = i2c_write(OLED_ADDR, 0x40, frame, PKT_SIZE);
+		if(err == I2C_OK) err = i2c_read_2ba(EEP_ADDR, 0x00, 0x00, page, 2);
+	}
+	uint32_t total = SysTick->CNT - start;
+	loads = i2c_speed_switches(&ticks) - start_loads;
+	ticks -= start_ticks;
+
+	bench_report("oled + eeprom mixed", total, FRAME_PKTS * (PKT_SIZE + 2), err);
+	printf("speed switches: %lu  cycles each: %lu  share: %lu%%\n", loads,
+		loads ? TICKS_TO_CYCLES(ticks) / loads : 0, ticks * 100 / total);
+
+	i2c_set_speed(OLED_ADDR, 0);
+}
+#endif
+
+#ifdef I2C_USE_PEC
+/* Ticks of one OLED frame sent as 0x40 prefixed packets, with [flags] */
+uint32_t bench_frame_ticks(uint8_t flags, i2c_err_t *err)
+{
+	i2c_xfer_t xfer = {.addr = OLED_ADDR, .flags = flags, .reg_len = 1,
+	                   .reg = {0x40}, .wbuf = frame, .wlen = PKT_SIZE};
+	*err = I2C_OK;
+
+	uint32_t start = SysTick->CNT;
+	for(uint8_t run = 0; run < RUNS; run++)
+		for(uint8_t pkt = 0; pkt < FRAME_PKTS && *err == I2C_OK; pkt++)
+			*err = i2c_xfer(&xfer);
+	return (SysTick->CNT - start) / RUNS;
+}
+
+/* OLED frame with a PEC byte after every packet, against the same frame
+   without, on the current bus. The SSD1306 does not check a PEC, it takes
+   it as one more data byte, so the PEC write goes through. The difference
+   is what the PEC costs: the hardware adds it for one more byte-time, the
+   software bus works it out byte by byte as well */
+void bench_pec_write(const char *name)
+{
+	i2c_err_t err;
+	bench_idle_spins = 0;
+
+	uint32_t plain = bench_frame_ticks(0, &err);
+	if(err == I2C_OK)
+	{
+		uint32_t pec = bench_frame_ticks(I2C_XFER_PEC, &err);
+		bench_report(name, pec, FRAME_PKTS * PKT_SIZE, err);
+		printf("pec cost per frame  cycles: %ld\n",
+			(long)TICKS_TO_CYCLES(pec) - (long)TICKS_TO_CYCLES(plain));
+		return;
+	}
+	bench_report(name, plain, FRAME_PKTS * PKT_SIZE, err);
+}
+
+/* The CPU cost of the same PEC done in software, over the same bytes,
+   with no bus time */
+void bench_crc8(void)
+{
+	volatile uint8_t crc = 0;
+
+	uint32_t start = SysTick->CNT;
+	for(uint8_t run = 0; run < RUNS; run++)
+		for(uint8_t pkt = 0; pkt < FRAME_PKTS; pkt++) crc = i2c_crc8(0, frame, PKT_SIZE);
+	uint32_t ticks = SysTick->CNT - start;
+	(void)crc;
+
+	bench_report("software crc8", ticks / RUNS, FRAME_PKTS * PKT_SIZE, I2C_OK);
+}
+#endif
+
+/* Snapshot two eeprom words and the OLED status byte, once as three
+   separate transfers, then as one chain joined by repeated STARTs */
+void bench_chain(void)
+{
+	uint8_t snap[5];
+	i2c_xfer_t links[3] = {
+		{.addr = EEP_ADDR,  .reg_len = 2, .reg = {0x00, 0x00}, .rbuf = &snap[0], .rlen = 2},
+		{.addr = EEP_ADDR,  .reg_len = 2, .reg = {0x00, 0x40}, .rbuf = &snap[2], .rlen = 2},
+		{.addr = OLED_ADDR, .rbuf = &snap[4], .rlen = 1},
+	};
+
+	i2c_err_t err = I2C_OK;
+	bench_idle_spins = 0;
+
+	uint32_t start = SysTick->CNT;
+	for(uint8_t run = 0; run < RUNS; run++)
+		for(uint8_t k = 0; k < 3 && err == I2C_OK; k++)
+			err = i2c_xfer(&links[k]);
+	uint32_t ticks = SysTick->CNT - start;
+	bench_report("snapshot separate", ticks / RUNS, sizeof(snap), err);
+
+	err = I2C_OK;
+	start = SysTick->CNT;
+	for(uint8_t run = 0; run < RUNS && err == I2C_OK; run++)
+		err = i2c_chain(links, 3);
+	ticks = SysTick->CNT - start;
+	bench_report("snapshot chained", ticks / RUNS, sizeof(snap), err);
+}
+
+int main()
+{
+	SystemInit();
+
+	if(i2c_init(I2C_CLK_400KHZ) != I2C_OK) printf("Failed to init the I2C Bus\n");
+	if(i2c_recover() != I2C_OK) printf("I2C Bus is held low\n");
+
+	for(uint8_t k = 0; k < PKT_SIZE; k++) frame[k] = k;
+
+	#ifdef I2C_USE_SOFT
+	i2c_bus_init(&soft_bus);
+	#endif
+
+	/* The bus runs at the closest rate the clock planner could reach */
+	printf("bus: asked %lu Hz  real %lu Hz\n", (uint32_t)I2C_CLK_400KHZ,
+		i2c_bus_current()->clk_real);
+
+	/* Boot time scan, then check the devices from the presence table */
+	i2c_scan(NULL);
+	printf("scan: %lu us  oled: %d  eeprom: %d\n", i2c_scan_time_us(),
+		i2c_is_present(OLED_ADDR), i2c_is_present(EEP_ADDR));
+
+	#ifdef I2C_USE_DMA
+	printf("----lib_i2c benchmark, DMA (threshold %d bytes)----\n", I2C_DMA_THRESHOLD);
+	#else
+	printf("----lib_i2c benchmark, polled----\n");
+	#endif
+
+	while(1)
+	{
+		bench_oled_frame("oled frame");
+		bench_oled_frame_v();
+		bench_eep_read("eeprom page read");
+		bench_chain();
+
+		#ifdef I2C_USE_WFI
+		bench_oled_sleep();
+		#endif
+
+		#ifdef I2C_USE_SPEEDS
+		bench_speeds();
+		#endif
+
+		#ifdef I2C_USE_PEC
+		bench_pec_write("oled frame pec");
+		bench_crc8();
+		#endif
+
+		#ifdef I2C_USE_SOFT
+		i2c_bus_t *hw_bus = i2c_bus_current();
+		i2c_bus_select(&soft_bus);
+		bench_eep_read("soft 1MHz page read");
+		#ifdef I2C_USE_PEC
+		bench_pec_write("soft 1MHz oled frame pec");
+		#endif
+		i2c_bus_select(hw_bus);
+		#endif
+
+		i2c_stats_print();
+		printf("\n");
+		Delay_Ms(1000);
+	}
+}
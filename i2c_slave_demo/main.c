@@ -0,0 +1,99 @@
+/* I2C Slave demo for lib_i2c_slave.
+
+   The CH32v003 answers at address 0x42 as a co-processor, with a 16 byte
+   register file on the default I2C pins (SCL = PC2, SDA = PC1):
+
+     0x00 - 0x03  uptime in ms, little endian     read-only
+     0x04         LED on PD0, 1 = on              read/write
+     0x05 - 0x0E  scratch                         read/write
+     0x0F         command, reads back as 0x00     write-only
+
+   From a Linux host with i2c-tools:
+     i2cget -y 1 0x42 0x00 i      read the uptime
+     i2cset -y 1 0x42 0x04 1      LED on
+     i2cdump -y 1 0x42 i          dump the register file
+
+   Every second the demo prints how many reads and writes it served, and
+   the latency from address match to the first data byte.
+*/
+
+#include "ch32fun.h"
+#include "lib_i2c_slave.h"
+#include <stdio.h>
+
+#define SLAVE_ADDR   0x42
+#define REG_UPTIME   0x00
+#define REG_LED      0x04
+#define REG_CMD      0x0F
+#define REG_COUNT    16
+
+uint8_t regs[REG_COUNT];
+
+/* 1 bit per register, LSB first */
+const uint8_t ro_mask[2] = {0x0F, 0x00};
+const uint8_t wo_mask[2] = {0x00, 0x80};
+
+volatile uint8_t cmd_pending;
+
+/* Called from the I2C Interrupt after the master wrote some registers */
+void regs_changed(const uint8_t first, const uint16_t len)
+{
+	for(uint16_t k = 0; k < len; k++)
+	{
+		uint8_t reg = (first + k) % REG_COUNT;
+		if(reg == REG_LED)
+		{
+			funDigitalWrite(PD0, regs[REG_LED] ? FUN_HIGH : FUN_LOW);
+		}
+		if(reg == REG_CMD) cmd_pending = 1;
+	}
+}
+
+const i2c_slave_t slave = {
+	.addr      = SLAVE_ADDR,
+	.regs      = regs,
+	.size      = REG_COUNT,
+	.ro_mask   = ro_mask,
+	.wo_mask   = wo_mask,
+	.on_change = regs_changed,
+};
+
+int main()
+{
+	SystemInit();
+	funGpioInitAll();
+	funPinMode(PD0, GPIO_Speed_10MHz | GPIO_CNF_OUT_PP);
+
+	if(i2c_slave_init(&slave) != I2C_OK) printf("Failed to init the I2C Slave\n");
+	printf("----I2C Slave at 0x%02X----\n", SLAVE_ADDR);
+
+	uint32_t ms = 0;
+	while(1)
+	{
+		Delay_Ms(1);
+		ms++;
+
+		/* Update the uptime with the I2C Interrupt off, so a read can not
+		   catch half of it */
+		NVIC_DisableIRQ(I2C1_EV_IRQn);
+		regs[REG_UPTIME + 0] = ms;
+		regs[REG_UPTIME + 1] = ms >> 8;
+		regs[REG_UPTIME + 2] = ms >> 16;
+		regs[REG_UPTIME + 3] = ms >> 24;
+		NVIC_EnableIRQ(I2C1_EV_IRQn);
+
+		if(cmd_pending)
+		{
+			printf("command 0x%02X\n", regs[REG_CMD]);
+			cmd_pending = 0;
+		}
+
+		if(ms % 1000 == 0)
+		{
+			const i2c_slave_stats_t *st = i2c_slave_stats();
+			printf("reads: %lu (dma %lu)  writes: %lu  errors: %d  latency last: %lu max: %lu ticks\n",
+				st->reads, st->dma_reads, st->writes, st->errors,
+				st->latency_last, st->latency_max);
+		}
+	}
+}
@@ -40,59 +40,406 @@
    The i2c lib auto adds the last 0 or 1 bit for read or write */
 #define I2C_ADDR    0x52  
 #define EEP_PGSZ    64  /* page size in bytes */
+#define EEP_SIZE    32768  /* bytes in a 24LC256 */
+#define EEP_TWR_MAX_MS  10  /* give up on a write cycle after this long */
 
 
-/** 
- * @brief eeprom usually has a page size and pages start at 0x0.
- * they will write page size bytes, but if not started at a
- * page boundary different things may happen.  data may stop 
- * writing, or roll over to the beginning of the page. 
+/* set while the eeprom may still be in its internal write cycle, which
+   started at SysTick value eep_twr_start */
+volatile uint8_t eep_busy = 0;
+uint32_t eep_twr_start;
+
+/** @brief note that a write cycle has just started. */
+void eep_twr_begin(void)
+{
+    eep_twr_start = SysTick->CNT;
+    eep_busy = 1;
+}
+
+/**
+ * @brief check once, without waiting, whether the write cycle is over, by
+ * ACK polling: the eeprom does not answer its address until the cycle is
+ * over.  A cycle running past EEP_TWR_MAX_MS is given up on.
+ * @return 1 if the eeprom is ready, 0 if it is still busy, or
+ * I2C_ERR_TIMEOUT if it did not come back in time
+ */
+uint8_t eep_poll_ready(void)
+{
+    if (!eep_busy) return 1;
+
+    /* a ping is the address byte and a STOP, on a short deadline */
+    i2c_xfer_t ping = {.addr = I2C_ADDR, .timeout_us = 500};
+    if (i2c_xfer(&ping) == I2C_OK) {
+        eep_busy = 0;
+        return 1;
+    }
+    if (SysTick->CNT - eep_twr_start > Ticks_from_Us(EEP_TWR_MAX_MS * 1000)) {
+        eep_busy = 0;
+        return I2C_ERR_TIMEOUT;
+    }
+    return 0;
+}
+
+/**
+ * @brief wait for the eeprom to finish its internal write cycle, pinging
+ * it until it ACKs.  Returns at once if nothing was written since the
+ * last wait.  The eep_ functions call it themselves.
+ * @return 0 for ok, or I2C_ERR_TIMEOUT if the eeprom did not come back
+ * within EEP_TWR_MAX_MS
+ */
+uint8_t eep_wait_ready(void)
+{
+    uint8_t ready;
+    while ((ready = eep_poll_ready()) == 0);
+    return (ready == 1) ? 0 : ready;
+}
+
+#ifdef EEP_USE_QUEUE
+/* Write-behind queue.  eep_enqueue() copies the data into page sized
+   slots and returns, eep_step() writes them out one page at a time from
+   the main loop, doing one ACK poll per call while a page is programmed,
+   so the 5ms write cycles overlap with other work.  eep_step() can be
+   called from a timer Interrupt instead, if the main loop then only uses
+   eep_enqueue() and eep_queue_depth() while the queue is not empty */
+#ifndef EEP_QUEUE_LEN
+#define EEP_QUEUE_LEN 4  /* pages, must be a power of 2 */
+#endif
+
+typedef struct {
+    uint16_t addr;
+    uint8_t  len;
+    uint8_t  data[EEP_PGSZ];
+} eep_qpage_t;
+
+eep_qpage_t eep_queue[EEP_QUEUE_LEN];
+/* free running, the slot is the count & (EEP_QUEUE_LEN - 1) */
+volatile uint8_t eep_q_head, eep_q_tail;
+/* deepest the queue has been, pages written, first error since a flush */
+uint8_t  eep_q_max;
+uint32_t eep_q_pages;
+uint8_t  eep_q_err;
+
+/**
+ * @brief queue a write of any length from any address, split at the page
+ * boundaries like eep_write.  The data is copied, the buffer can be
+ * reused straight away, and data that runs on from the last queued write
+ * in the same page is merged into it.  Nothing is queued unless all of
+ * it fits.
  * @param addr 2 byte address to write the buffer to
  * @param buf  the data to write
- * @param bufsize  size of the data buffer 
- * @return 0 for ok, or 253 for error OR the buf was not aligned properly
- * or regular i2c return codes
+ * @param bufsize  size of the data buffer
+ * @return 0 for ok, 252 if the queue does not have room for it, 253 if
+ * the data runs past the end of the eeprom
  */
-uint8_t eep_write(uint16_t addr, uint8_t *buf, uint8_t bufsize)
+uint8_t eep_enqueue(uint16_t addr, const uint8_t *buf, uint16_t bufsize)
 {
-    uint8_t testsize;
-
-    /* check page start addr, if not on a boundary and
-       data wont fit then return a err code */
-    if ( addr % EEP_PGSZ != 0 ){
-        /* adjust the number of bytes to write */
-        testsize = EEP_PGSZ - (addr % EEP_PGSZ);
-        if (testsize > bufsize){  /*then this data will fit */
+    if ((uint32_t)addr + bufsize > EEP_SIZE) {
+        return 253;
+    }
+
+    /* pages it will take */
+    uint16_t pages = (addr % EEP_PGSZ + bufsize + EEP_PGSZ - 1) / EEP_PGSZ;
+    uint8_t depth = eep_q_tail - eep_q_head;
+    if (pages > EEP_QUEUE_LEN - depth) {
+        return 252;
+    }
+
+    while (bufsize > 0) {
+        uint16_t chunk = EEP_PGSZ - (addr % EEP_PGSZ);
+        if (chunk > bufsize) chunk = bufsize;
+
+        /* data that carries on from the last slot in the same page joins
+           it.  Not the head slot, eep_step() may be writing that one.
+           Interrupts are off from the check to the update, so a timer
+           eep_step() can not retire the head and start on this slot */
+        eep_qpage_t *last = &eep_queue[(eep_q_tail - 1) & (EEP_QUEUE_LEN - 1)];
+        uint8_t irq = __isenabled_irq();
+        __disable_irq();
+        uint8_t merge = (uint8_t)(eep_q_tail - eep_q_head) >= 2 &&
+                        addr % EEP_PGSZ != 0 && last->addr + last->len == addr;
+        if (merge) {
+            memcpy(&last->data[last->len], buf, chunk);
+            last->len += chunk;
         }
-        else {  /* the buf data wont fit which may cause strange results */
-            return 253;
+        if (irq) __enable_irq();
+
+        if (!merge) {
+            eep_qpage_t *pg = &eep_queue[eep_q_tail & (EEP_QUEUE_LEN - 1)];
+            pg->addr = addr;
+            pg->len = chunk;
+            memcpy(pg->data, buf, chunk);
+            /* the slot is filled in before eep_step() can see it */
+            eep_q_tail++;
         }
+
+        addr += chunk;
+        buf += chunk;
+        bufsize -= chunk;
     }
-    /* write the data */
-    if (sizeof(*buf)<=64) {
-        return i2c_write_2ba(I2C_ADDR,addr&0x00ff,addr>>8,buf,bufsize);
+
+    depth = eep_q_tail - eep_q_head;
+    if (depth > eep_q_max) eep_q_max = depth;
+    return 0;
+}
+
+/**
+ * @brief move the queue on, never waiting for the eeprom.  While a page
+ * is programmed this is one ACK poll, once it is done the next page is
+ * written.  Failed pages are dropped, their error is kept for eep_flush.
+ * @return pages not finished yet, queued or being programmed
+ */
+uint8_t eep_step(void)
+{
+    uint8_t ready = eep_poll_ready();
+    if (ready == 0) return (uint8_t)(eep_q_tail - eep_q_head) + 1;
+    if (ready != 1 && eep_q_err == 0) eep_q_err = ready;
+
+    if (eep_q_head == eep_q_tail) return 0;
+
+    eep_qpage_t *pg = &eep_queue[eep_q_head & (EEP_QUEUE_LEN - 1)];
+    uint8_t ret = i2c_write_2ba(I2C_ADDR,pg->addr&0x00ff,pg->addr>>8,pg->data,pg->len);
+    /* the bus belongs to a transfer this interrupted, try again next time */
+    if (ret == I2C_ERR_BUSY) return eep_q_tail - eep_q_head;
+
+    if (ret == 0) {
+        eep_twr_begin();
+        eep_q_pages++;
+    } else if (eep_q_err == 0) {
+        eep_q_err = ret;
     }
-    else {
-        /* buffer is too large for write area */
-        return 255;
+    eep_q_head++;
+    return (uint8_t)(eep_q_tail - eep_q_head) + eep_busy;
+}
+
+/**
+ * @brief barrier, write out everything queued and wait for the last
+ * write cycle.  eep_write, eep_writev and eep_read call it first, so
+ * they always see the queued data.
+ * @return 0 for ok, or the first error of the pages written since the
+ * last flush
+ */
+uint8_t eep_flush(void)
+{
+    while (eep_step()) {
+        /* nothing else to do meanwhile, so wait the write cycle out */
+        uint8_t ret = eep_wait_ready();
+        if (ret && eep_q_err == 0) eep_q_err = ret;
     }
+    uint8_t ret = eep_q_err;
+    eep_q_err = 0;
+    return ret;
+}
+
+/**
+ * @brief how full the write-behind queue is.
+ * @param max  set to the deepest it has been, can be NULL
+ * @param pages  set to the number of pages written from it, can be NULL
+ * @return pages queued now, not counting one being programmed
+ */
+uint8_t eep_queue_depth(uint8_t *max, uint32_t *pages)
+{
+    if (max) *max = eep_q_max;
+    if (pages) *pages = eep_q_pages;
+    return eep_q_tail - eep_q_head;
+}
+#endif
+
+/** 
+ * @brief write any number of bytes from any address.  The eeprom only
+ * takes one page per write, and wraps around inside the page if the
+ * write runs past its end, so the data is split at the page boundaries
+ * and each page waits for the write cycle of the one before with
+ * eep_wait_ready().  A full page costs one write cycle, so aligned 64 byte
+ * chunks give the best throughput.
+ * @param addr 2 byte address to write the buffer to
+ * @param buf  the data to write
+ * @param bufsize  size of the data buffer, up to EEP_SIZE
+ * @return 0 for ok, 253 if the data runs past the end of the eeprom,
+ * or regular i2c return codes
+ */
+uint8_t eep_write(uint16_t addr, const uint8_t *buf, uint16_t bufsize)
+{
+    uint8_t ret;
+
+    if ((uint32_t)addr + bufsize > EEP_SIZE) {
+        return 253;
+    }
+#ifdef EEP_USE_QUEUE
+    ret = eep_flush();
+    if (ret) return ret;
+#endif
+
+    while (bufsize > 0) {
+        /* up to the end of the page addr is in */
+        uint16_t chunk = EEP_PGSZ - (addr % EEP_PGSZ);
+        if (chunk > bufsize) chunk = bufsize;
+
+        ret = eep_wait_ready();
+        if (ret) return ret;
+        ret = i2c_write_2ba(I2C_ADDR,addr&0x00ff,addr>>8,buf,chunk);
+        if (ret) return ret;
+        eep_twr_begin();
+
+        addr += chunk;
+        buf += chunk;
+        bufsize -= chunk;
+    }
+    return 0;
+}
+
+/** 
+ * @brief write data gathered from a list of segments, eg a record header
+ * and its payload, as one write with no staging buffer.  Unlike eep_write
+ * it is not split at the page boundaries, the total size must fit in the
+ * page from addr on.
+ * @param addr 2 byte address to write the data to
+ * @param iov  the segments to write, in order
+ * @param iovcnt  number of segments
+ * @return 0 for ok, 253 if the data would cross the end of the page,
+ * or regular i2c return codes
+ */
+uint8_t eep_writev(uint16_t addr, const i2c_iovec_t *iov, uint8_t iovcnt)
+{
+    uint16_t total = 0;
+    for (uint8_t k = 0; k < iovcnt; k++) total += iov[k].len;
+
+    /* one write cycle, so the whole write must fit in the page */
+    if (total > EEP_PGSZ - (addr % EEP_PGSZ)) {
+        return 253;
+    }
+
+#ifdef EEP_USE_QUEUE
+    uint8_t ret = eep_flush();
+#else
+    uint8_t ret = eep_wait_ready();
+#endif
+    if (ret) return ret;
+
+    i2c_xfer_t xfer = {.addr = I2C_ADDR, .reg_len = 2, .reg = {addr >> 8, addr & 0x00ff},
+                       .wvec = iov, .wvec_len = iovcnt};
+    ret = i2c_xfer(&xfer);
+    if (ret == 0) eep_twr_begin();
+    return ret;
 }
 
 /** 
  * @brief eeprom reading is more forgiving. 
- * Here just follow the same 64byte read, but the user can 
- * read as few bytes as desired, and also read from any
- * address location.
+ * Reads run on across the pages, so any number of bytes can be
+ * read from any address location in one go.  Waits for a write
+ * cycle that is still going first.
  * @param addr 2 byte address to write the buffer to
  * @param buf  the data to write
  * @param bufsize  size of the data buffer 
  * @return regular i2c lib return codes
  */
-uint8_t eep_read(uint16_t addr, uint8_t *buf, uint8_t bufsize)
+uint8_t eep_read(uint16_t addr, uint8_t *buf, uint16_t bufsize)
 {
-    i2c_err_t ret;
+#ifdef EEP_USE_QUEUE
+    i2c_err_t ret = eep_flush();
+#else
+    i2c_err_t ret = eep_wait_ready();
+#endif
+    if (ret) return ret;
     ret= i2c_read_2ba(I2C_ADDR,addr&0x00ff,addr>>8,buf,bufsize);
     return ret;
 }
 
+/**
+ * @brief stream [len] bytes from [addr] in one sequential read, however
+ * long: the address is sent once, and the eeprom keeps sending the bytes
+ * after it for as long as they are ACKed.  [buf] only needs to hold
+ * [chunk] bytes, it is handed to [on_chunk] each time it fills, and once
+ * more with what is left at the end.  A whole 24LC256 is one transfer of
+ * 32768 bytes, running at the bus rate.
+ * @param addr 2 byte address to start reading from
+ * @param len  number of bytes to read, up to EEP_SIZE
+ * @param buf  buffer the bytes pass through
+ * @param chunk  size of buf
+ * @param on_chunk  called with each chunk, returns 0 to stop reading
+ * (see i2c_xfer_t), it must be quick, the read has a deadline worked out
+ * from its length.  Stopping still clocks at least one byte past the
+ * chunk out of the eeprom, which is dropped
+ * @return 0 for ok, 253 if the read runs past the end of the eeprom or
+ * buf, chunk or on_chunk is missing, or regular i2c return codes
+ */
+uint8_t eep_stream(uint16_t addr, uint16_t len, uint8_t *buf, uint16_t chunk,
+                   uint8_t (*on_chunk)(i2c_xfer_t *, const uint8_t *, const uint16_t))
+{
+    if ((uint32_t)addr + len > EEP_SIZE) {
+        return 253;
+    }
+    if (buf == NULL || chunk == 0 || on_chunk == NULL) {
+        return 253;
+    }
+#ifdef EEP_USE_QUEUE
+    uint8_t ret = eep_flush();
+#else
+    uint8_t ret = eep_wait_ready();
+#endif
+    if (ret) return ret;
+
+    i2c_xfer_t xfer = {.addr = I2C_ADDR, .reg_len = 2, .reg = {addr >> 8, addr & 0x00ff},
+                       .rbuf = buf, .rlen = len, .rchunk = chunk, .on_chunk = on_chunk};
+    return i2c_xfer(&xfer);
+}
+
+#ifdef I2C_USE_SPEEDS
+#define EEP_SPEED_MAGIC 0x5D  /* marks a saved speed table */
+
+/**
+ * @brief save the lib_i2c speed table of the current bus, eg after
+ * i2c_calibrate(), so it can be restored at the next boot without
+ * calibrating again.  Stored as a
+ * magic byte, the entry count, then 5 bytes per entry: the device address
+ * and its clock in Hz, LSB first.
+ * @param addr 2 byte address to save to
+ * @return 0 for ok, or the eep_write return codes
+ */
+uint8_t eep_save_speeds(uint16_t addr)
+{
+    uint8_t addrs[I2C_SPEED_SLOTS];
+    uint32_t rates[I2C_SPEED_SLOTS];
+    uint8_t buf[2 + 5 * I2C_SPEED_SLOTS];
+
+    uint8_t count = i2c_speed_list(addrs, rates);
+    buf[0] = EEP_SPEED_MAGIC;
+    buf[1] = count;
+    for (uint8_t k = 0; k < count; k++) {
+        uint8_t *rec = &buf[2 + 5 * k];
+        rec[0] = addrs[k];
+        for (uint8_t b = 0; b < 4; b++) rec[1 + b] = rates[k] >> (8 * b);
+    }
+
+    uint8_t ret = eep_write(addr, buf, 2 + 5 * count);
+    /* finish the write cycle before anything else talks to the bus */
+    if (ret == 0) ret = eep_wait_ready();
+    return ret;
+}
+
+/**
+ * @brief restore a speed table saved with eep_save_speeds.
+ * @param addr 2 byte address it was saved to
+ * @return 0 for ok, 254 if nothing valid was saved there, or regular i2c
+ * return codes
+ */
+uint8_t eep_load_speeds(uint16_t addr)
+{
+    uint8_t buf[2 + 5 * I2C_SPEED_SLOTS];
+
+    uint8_t ret = eep_read(addr, buf, 2);
+    if (ret) return ret;
+    if (buf[0] != EEP_SPEED_MAGIC || buf[1] > I2C_SPEED_SLOTS) return 254;
+
+    ret = eep_read(addr + 2, &buf[2], 5 * buf[1]);
+    if (ret) return ret;
+    for (uint8_t k = 0; k < buf[1]; k++) {
+        uint8_t *rec = &buf[2 + 5 * k];
+        uint32_t rate = 0;
+        for (uint8_t b = 0; b < 4; b++) rate |= (uint32_t)rec[1 + b] << (8 * b);
+        i2c_set_speed(rec[0], rate);
+    }
+    return 0;
+}
+#endif
+
 #endif
@@ -0,0 +1,186 @@
+/******************************************************************************
+* Register shadow cache for lib_i2c devices.
+*
+* Keeps a RAM copy of a run of up to 32 registers of one device, so drivers
+* can stop re-reading registers that only change when they write them.
+* Every register is one of:
+*   Cacheable  - only changes when written. Served from RAM once it is known
+*   Volatile   - changed by the device (flags, counters, time). Always read
+*   Write-only - can not be read back. Served from RAM, starting from the
+*                value the shadow was declared with (eg the reset default)
+*
+* The RAM cost is the shadow bytes, plus three bitmaps and two counters.
+* Anything that changes the device behind the cache's back (a reset, a
+* power cycle, a write made with i2c_write()) must be followed by
+* i2c_rc_invalidate(). Registers outside the run go straight to the device.
+*
+* Single-File-Header. Not for use from Interrupt handlers.
+*
+* Released under the MIT Licence
+******************************************************************************/
+#ifndef CH32_I2C_REGCACHE_H
+#define CH32_I2C_REGCACHE_H
+
+#include <stdint.h>
+#include <string.h>
+#include "lib_i2c.h"
+
+/*** Types *******************************************************************/
+// Register Cache of one device. Set up with I2C_REGCACHE()
+typedef struct {
+	uint8_t  addr;      // 7 Bit Device Address
+	uint8_t  base;      // First register covered
+	uint8_t  count;     // Number of registers covered, 1 - 32
+	uint32_t cacheable; // 1 bit per register, from [base]
+	uint32_t writeonly; // 1 bit per register, from [base]
+	uint32_t valid;     // 1 bit per register, set while the shadow is right
+	uint16_t hits;      // Register reads served from RAM
+	uint16_t misses;    // Register reads that went to the device
+	uint8_t *shadow;    // [count] bytes
+} i2c_regcache_t;
+
+// Defines [name], a cache of registers [base] to [base + count - 1] of
+// [addr]. [cacheable] and [writeonly] are bitmaps, bit 0 = register [base],
+// volatile registers have neither bit set. The trailing arguments are the
+// starting shadow values, used for write-only registers until written
+#define I2C_REGCACHE(name, addr, base, count, cacheable, writeonly, ...) \
+	uint8_t name##_shadow[count] = {__VA_ARGS__}; \
+	i2c_regcache_t name = {(addr), (base), (count), (cacheable), (writeonly), \
+	                       (writeonly), 0, 0, name##_shadow}
+
+// Bitmap of [len] registers from [reg], relative to the cache base
+#define I2C_RC_BITS(rc, reg, len) \
+	((((len) >= 32) ? 0xFFFFFFFF : ((1UL << (len)) - 1)) << ((reg) - (rc)->base))
+
+
+/*** Functions ***************************************************************/
+/// @brief Checks whether [len] registers from [reg] all sit in the cache
+/// @param rc, Register Cache
+/// @param reg, first register
+/// @param len, number of registers
+/// @return uint8_t, 1 if they are all covered
+static inline uint8_t i2c_rc_covers(const i2c_regcache_t *rc, const uint8_t reg,
+                                    const uint8_t len)
+{
+	return len != 0 && reg >= rc->base && reg + len <= rc->base + rc->count;
+}
+
+/// @brief Forgets what the cache knows of [len] registers from [reg], so
+/// the next read goes to the device. Write-only registers keep their value
+/// @param rc, Register Cache
+/// @param reg, first register
+/// @param len, number of registers
+/// @return None
+void i2c_rc_invalidate(i2c_regcache_t *rc, const uint8_t reg, const uint8_t len)
+{
+	if(!i2c_rc_covers(rc, reg, len)) return;
+	rc->valid &= ~(I2C_RC_BITS(rc, reg, len) & ~rc->writeonly);
+}
+
+/// @brief Forgets every register of the cache. Use after the device has
+/// been reset or written to by something else
+/// @param rc, Register Cache
+/// @return None
+void i2c_rc_invalidate_all(i2c_regcache_t *rc)
+{
+	rc->valid &= rc->writeonly;
+}
+
+/// @brief Reads [len] registers from [reg] into [buf]. Registers the cache
+/// knows are copied from RAM, the rest are read from the device in one
+/// transfer, from the first to the last one that is needed
+/// @param rc, Register Cache
+/// @param reg, first register
+/// @param buf, Buffer to read into
+/// @param len, number of registers
+/// @return i2c_err_t. I2C_OK On Success
+i2c_err_t i2c_rc_read(i2c_regcache_t *rc, const uint8_t reg, uint8_t *buf,
+                      const uint8_t len)
+{
+	if(!i2c_rc_covers(rc, reg, len)) return i2c_read(rc->addr, reg, buf, len);
+
+	uint8_t off = reg - rc->base;
+	uint32_t need = I2C_RC_BITS(rc, reg, len) & ~rc->valid;
+
+	if(need != 0)
+	{
+		// Trim the read down to the registers that are not known
+		uint8_t first = off, last = off + len - 1;
+		while(!(need & (1UL << first))) first++;
+		while(!(need & (1UL << last)))  last--;
+
+		uint8_t n = last - first + 1;
+		i2c_err_t i2c_ret = i2c_read(rc->addr, rc->base + first, &buf[first - off], n);
+		if(i2c_ret != I2C_OK) return i2c_ret;
+		rc->misses += n;
+
+		// Keep what was read, it is only trusted for cacheable registers.
+		// Write-only registers read back garbage, those come from RAM
+		for(uint8_t r = first; r <= last; r++)
+		{
+			if(rc->writeonly & (1UL << r)) continue;
+			rc->shadow[r] = buf[r - off];
+		}
+		rc->valid |= I2C_RC_BITS(rc, rc->base + first, n) & rc->cacheable;
+	}
+
+	for(uint8_t r = off; r < off + len; r++)
+	{
+		if(!(need & (1UL << r)))
+		{
+			buf[r - off] = rc->shadow[r];
+			rc->hits++;
+		}
+	}
+	return I2C_OK;
+}
+
+/// @brief Writes [len] registers from [reg] to the device, and keeps the
+/// values for the cacheable and write-only ones
+/// @param rc, Register Cache
+/// @param reg, first register
+/// @param buf, Buffer to write from
+/// @param len, number of registers
+/// @return i2c_err_t. I2C_OK On Success. On failure the registers written
+/// are forgotten, the device may hold old or new values
+i2c_err_t i2c_rc_write(i2c_regcache_t *rc, const uint8_t reg, const uint8_t *buf,
+                       const uint8_t len)
+{
+	i2c_err_t i2c_ret = i2c_write(rc->addr, reg, buf, len);
+	if(!i2c_rc_covers(rc, reg, len)) return i2c_ret;
+
+	uint32_t bits = I2C_RC_BITS(rc, reg, len);
+	if(i2c_ret != I2C_OK)
+	{
+		i2c_rc_invalidate(rc, reg, len);
+		return i2c_ret;
+	}
+
+	memcpy(&rc->shadow[reg - rc->base], buf, len);
+	rc->valid |= bits & (rc->cacheable | rc->writeonly);
+	return I2C_OK;
+}
+
+/// @brief Read-modify-write of one register: the bits in [mask] are set to
+/// those of [bits], the rest are kept. Known registers are not read, and
+/// nothing is written if a known register would not change
+/// @param rc, Register Cache
+/// @param reg, register to change
+/// @param mask, bits to change
+/// @param bits, new value of the [mask] bits
+/// @return i2c_err_t. I2C_OK On Success
+i2c_err_t i2c_rc_update(i2c_regcache_t *rc, const uint8_t reg, const uint8_t mask,
+                        const uint8_t bits)
+{
+	uint8_t value;
+	i2c_err_t i2c_ret = i2c_rc_read(rc, reg, &value, 1);
+	if(i2c_ret != I2C_OK) return i2c_ret;
+
+	uint8_t next = (value & ~mask) | (bits & mask);
+	if(next == value && i2c_rc_covers(rc, reg, 1) &&
+	   (rc->valid & I2C_RC_BITS(rc, reg, 1))) return I2C_OK;
+
+	return i2c_rc_write(rc, reg, &next, 1);
+}
+
+#endif
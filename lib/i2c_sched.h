@@ -0,0 +1,197 @@
+/******************************************************************************
+* Periodic poll scheduler for lib_i2c devices.
+*
+* Jobs are released every [period_us], from SysTick, and run their transfer
+* then their callback. Jobs are ranked rate-monotonic: the shorter the
+* period, the higher the priority, and each i2c_sched_poll() runs the most
+* urgent job that is due. A job that finishes later than [deadline_us]
+* after its release, or misses whole releases, counts a deadline miss. The
+* delay from release to start is kept as the job's jitter.
+*
+* Background jobs (I2C_JOB_BACKGROUND), eg display refreshes, rank below
+* every periodic job. Once released they run a step at a time, one step
+* per i2c_sched_poll() that has nothing periodic due, until their callback
+* returns 0. A long refresh is so preempted by the polls between its steps.
+*
+* The main loop calls i2c_sched_poll() as often as it can, in place of
+* hand-timed Delay_Ms() loops. Not for use from Interrupt handlers.
+*
+* Single-File-Header.
+*
+* Released under the MIT Licence
+******************************************************************************/
+#ifndef CH32_I2C_SCHED_H
+#define CH32_I2C_SCHED_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "lib_i2c.h"
+
+/*** Types *******************************************************************/
+// Job Flags
+#define I2C_JOB_BACKGROUND 0x01 // Below every periodic job, run in steps
+#define I2C_JOB_ACTIVE     0x80 // Set by the scheduler while a step is due
+
+// Scheduled Job. Fill in the fields up to [flags], then i2c_sched_add()
+typedef struct i2c_job {
+	const char *name;       // Printed by i2c_sched_print()
+	i2c_xfer_t  xfer;       // Run at every release (every step of background
+	                        // jobs). Nothing to transfer = callback only
+	uint32_t    period_us;  // Release period. 0 = as often as possible
+	uint32_t    deadline_us;// Finish this long after release, 0 = the period
+	// Called after the transfer, with its result in job->xfer.err. Background
+	// jobs return 1 while they have more steps to do, periodic jobs return 0
+	uint8_t   (*callback)(struct i2c_job *);
+	uint8_t     flags;      // I2C_JOB_* Flags
+
+	// Kept by the scheduler
+	uint32_t    release;    // SysTick value of the current release
+	uint32_t    started;    // SysTick value the current release started at
+	uint32_t    runs;       // Releases finished
+	uint32_t    misses;     // Releases finished late, or skipped
+	uint32_t    jitter_sum; // Ticks from release to start, summed
+	uint32_t    jitter_max; // The worst of them
+	struct i2c_job *next;
+} i2c_job_t;
+
+
+/*** Variables ***************************************************************/
+// Jobs in priority order, periodic ones first
+i2c_job_t *i2c_sched_jobs;
+
+
+/*** Functions ***************************************************************/
+/// @brief Gets whether a SysTick time has been reached
+/// @param when, SysTick->CNT value
+/// @return uint8_t, 1 if it is now or past
+static inline uint8_t i2c_sched_reached(const uint32_t when)
+{
+	return (int32_t)(SysTick->CNT - when) >= 0;
+}
+
+/// @brief Adds a job, ranked by its period, and releases it straight away.
+/// The job must stay in memory while it is scheduled
+/// @param job, Job to add
+/// @return None
+void i2c_sched_add(i2c_job_t *job)
+{
+	job->release    = SysTick->CNT;
+	job->runs       = 0;
+	job->misses     = 0;
+	job->jitter_sum = 0;
+	job->jitter_max = 0;
+	job->flags     &= ~I2C_JOB_ACTIVE;
+
+	// Shorter periods first, background jobs after all periodic ones
+	i2c_job_t **link = &i2c_sched_jobs;
+	while(*link != NULL)
+	{
+		uint8_t bg = (*link)->flags & I2C_JOB_BACKGROUND;
+		if(bg > (job->flags & I2C_JOB_BACKGROUND)) break;
+		if(bg == (job->flags & I2C_JOB_BACKGROUND) &&
+		   (*link)->period_us > job->period_us) break;
+		link = &(*link)->next;
+	}
+	job->next = *link;
+	*link = job;
+}
+
+/// @brief Takes a job off the schedule
+/// @param job, Job to remove
+/// @return None
+void i2c_sched_remove(i2c_job_t *job)
+{
+	for(i2c_job_t **link = &i2c_sched_jobs; *link != NULL; link = &(*link)->next)
+	{
+		if(*link != job) continue;
+		*link = job->next;
+		return;
+	}
+}
+
+/// @brief Ends the current release of a job. Checks its deadline, and
+/// moves on to the next release, counting any that were skipped
+/// @param job, Job that finished
+/// @return None
+static void i2c_sched_done(i2c_job_t *job)
+{
+	uint32_t now = SysTick->CNT;
+	uint32_t deadline = job->deadline_us ? job->deadline_us : job->period_us;
+
+	job->runs++;
+	if(deadline != 0 && now - job->release > Ticks_from_Us(deadline)) job->misses++;
+
+	uint32_t period = Ticks_from_Us(job->period_us);
+	job->release += period;
+	while(period != 0 && (int32_t)(now - (job->release + period)) >= 0)
+	{
+		job->release += period;
+		job->misses++;
+	}
+	if(period == 0) job->release = now;
+}
+
+/// @brief Runs the most urgent job that is due: a periodic job if one has
+/// been released, else the next step of a background job
+/// @param None
+/// @return uint8_t, 1 if a job was run, 0 if nothing was due
+uint8_t i2c_sched_poll(void)
+{
+	i2c_job_t *job = i2c_sched_jobs;
+	for(; job != NULL; job = job->next)
+		if((job->flags & I2C_JOB_ACTIVE) || i2c_sched_reached(job->release)) break;
+	if(job == NULL) return 0;
+
+	// First step of a release
+	if(!(job->flags & I2C_JOB_ACTIVE))
+	{
+		job->started = SysTick->CNT;
+		uint32_t jitter = job->started - job->release;
+		job->jitter_sum += jitter;
+		if(jitter > job->jitter_max) job->jitter_max = jitter;
+	}
+
+	const i2c_xfer_t *x = &job->xfer;
+	if(x->reg_len || x->wlen || x->wvec_len || x->rlen) i2c_xfer(&job->xfer);
+
+	uint8_t more = (job->callback != NULL) ? job->callback(job) : 0;
+	if(more && (job->flags & I2C_JOB_BACKGROUND))
+	{
+		job->flags |= I2C_JOB_ACTIVE;
+		return 1;
+	}
+
+	job->flags &= ~I2C_JOB_ACTIVE;
+	i2c_sched_done(job);
+	return 1;
+}
+
+/// @brief Clears the run, miss and jitter counts of every job
+/// @param None
+/// @return None
+void i2c_sched_reset_stats(void)
+{
+	for(i2c_job_t *job = i2c_sched_jobs; job != NULL; job = job->next)
+	{
+		job->runs       = 0;
+		job->misses     = 0;
+		job->jitter_sum = 0;
+		job->jitter_max = 0;
+	}
+}
+
+/// @brief Prints the runs, deadline misses and jitter of every job
+/// @param None
+/// @return None
+void i2c_sched_print(void)
+{
+	for(i2c_job_t *job = i2c_sched_jobs; job != NULL; job = job->next)
+	{
+		uint32_t avg = job->runs ? job->jitter_sum / job->runs : 0;
+		printf("%-8s  period: %lu us  runs: %lu  misses: %lu  jitter avg: %lu us  "
+		       "max: %lu us\n", job->name, job->period_us, job->runs, job->misses,
+		       avg / DELAY_US_TIME, job->jitter_max / DELAY_US_TIME);
+	}
+}
+
+#endif
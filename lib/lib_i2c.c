@@ -33,6 +33,90 @@
 #include "lib_i2c.h"
 #include <stddef.h>
 
+#ifdef I2C_USE_STATS
+#include <stdio.h>
+#endif
+
+#if defined(I2C_USE_SPEEDS) || defined(I2C_USE_COALESCE)
+#include <string.h>
+#endif
+
+/*** Static Variables ********************************************************/
+// Bus Handle used by i2c_init(), set up from the I2C_PINOUT_* selection
+static i2c_bus_t i2c_bus_pinout = I2C_BUS_PINOUT(0);
+
+// Bus Handle transfers run on when they do not name one
+static i2c_bus_t *i2c_bus;
+
+// Bus Handle I2C1 is muxed to. Differs from i2c_bus while a software bus
+// is selected
+static i2c_bus_t *i2c_hw;
+
+// Presence table of the last scan, 1 bit per 7 bit address
+static uint32_t i2c_present[4];
+
+// SysTick ticks the last scan took
+static uint32_t i2c_scan_ticks;
+
+#ifdef I2C_USE_STATS
+// Statistics slots, the last one is the overflow slot
+static i2c_stats_t i2c_stats[I2C_STATS_SLOTS + 1];
+// Set while scanning, pings to empty addresses are not counted
+static uint8_t i2c_stats_paused;
+#endif
+
+#ifndef I2C_USE_IRQ
+// SysTick value the running transfer has to finish by
+static uint32_t i2c_deadline;
+
+// Set while a context owns the bus. Transfers deferred from Interrupt
+// handlers in the meantime wait in the ring, and run when it is released
+static volatile uint8_t i2c_locked;
+static i2c_xfer_t *i2c_deferred[I2C_DEFER_LEN];
+static volatile uint8_t i2c_d_head, i2c_d_tail;
+#endif
+
+#ifdef I2C_USE_WFI
+// SysTick ticks spent asleep in WFI
+static uint32_t i2c_slept;
+#endif
+
+#ifdef I2C_USE_SPEEDS
+// Per-device bus clocks, keyed by bus and address. addr 0 marks a free slot
+typedef struct {
+	const i2c_bus_t *bus;
+	uint8_t  addr;
+	uint16_t ckcfgr;
+	uint32_t clk_rate;
+	uint32_t byte_ticks;
+} i2c_speed_t;
+static i2c_speed_t i2c_speeds[I2C_SPEED_SLOTS];
+// CKCFGR reloads, and the SysTick ticks spent doing them
+static uint32_t i2c_speed_loads, i2c_speed_ticks;
+// CKCFGR of the slowest link of the running chain, 0 = not in a chain
+static uint16_t i2c_speed_hold;
+#endif
+
+#ifdef I2C_USE_COALESCE
+// Write-combining buffer, registers [i2c_wc_reg] up, for one device on
+// one bus. i2c_wc_len 0 = nothing pending
+static const i2c_bus_t *i2c_wc_bus;
+static uint8_t  i2c_wc_addr, i2c_wc_reg, i2c_wc_len;
+static uint8_t  i2c_wc_buf[I2C_COALESCE_MAX];
+// SysTick value the pending write has to be sent by
+static uint32_t i2c_wc_deadline;
+// First error of a merged write since it was last reported. Merged writes
+// are often sent by another transfer, so their errors are kept for later
+static i2c_err_t i2c_wc_err;
+// Writes merged, and transfers sent for them
+static uint32_t i2c_wc_writes, i2c_wc_xfers;
+#ifdef I2C_USE_IRQ
+// The merged write on its way out. i2c_wc_buf is not touched until it is
+static i2c_xfer_t i2c_wc_xfer;
+#endif
+#endif
+
+
 /*** Static Functions ********************************************************/
 /// @brief Checks the I2C Status against a mask value, returns 1 if it matches
 /// @param Status To match to
@@ -59,370 +143,2270 @@ static inline i2c_err_t i2c_error(void)
 	if(I2C1->STAR1 & I2C_STAR1_ARLO) {I2C1->STAR1 &= ~I2C_STAR1_ARLO; return I2C_ERR_ARLO;}
 	// OVR
 	if(I2C1->STAR1 & I2C_STAR1_OVR) {I2C1->STAR1 &= ~I2C_STAR1_OVR; return I2C_ERR_OVR;}
+	// PEC
+	if(I2C1->STAR1 & I2C_STAR1_PECERR) {I2C1->STAR1 &= ~I2C_STAR1_PECERR; return I2C_ERR_PEC;}
 
 	return I2C_OK;
 }
 
-/// @brief Checks the current I2C Status, if it does not have an error state,
-/// it defaults to I2C_ERR_BUSY
-/// @param None
-/// @return i2c_err_t error value
-__attribute__((always_inline))
-static inline uint32_t i2c_get_busy_error(void)
+// STAR1 Error flags, any of these ends a transfer
+#define I2C_STAR1_ERRORS (I2C_STAR1_BERR | I2C_STAR1_AF | I2C_STAR1_ARLO | I2C_STAR1_OVR | \
+                          I2C_STAR1_PECERR)
+
+#ifdef I2C_USE_PEC
+// 1 if the transfer carries a PEC byte
+#define I2C_PEC(xfer) (((xfer)->flags & I2C_XFER_PEC) ? 1 : 0)
+
+/// @brief Turns hardware PEC on for a transfer that wants it, off for one
+/// that does not. Turning it on clears the PEC register
+/// @param xfer Transfer Descriptor
+/// @return None
+static void i2c_pec_begin(const i2c_xfer_t *xfer)
+{
+	I2C1->CTLR1 &= ~I2C_CTLR1_ENPEC;
+	if(I2C_PEC(xfer)) I2C1->CTLR1 |= I2C_CTLR1_ENPEC;
+}
+#define I2C_PEC_BEGIN(xfer) i2c_pec_begin(xfer)
+#else
+#define I2C_PEC(xfer) 0
+#define I2C_PEC_BEGIN(xfer)
+#endif
+
+/// @brief Gets one segment of the write phase of a transfer. Segment 0 is
+/// the Register prefix, then come the xfer->wvec segments, then wbuf
+/// @param xfer Transfer Descriptor
+/// @param seg segment number, 0 to xfer->wvec_len + 1
+/// @param buf where to store the segment pointer
+/// @return uint16_t segment length
+static uint16_t i2c_wseg(const i2c_xfer_t *xfer, const uint8_t seg, const uint8_t **buf)
+{
+	if(seg == 0)             {*buf = xfer->reg;                return xfer->reg_len;}
+	if(seg <= xfer->wvec_len) {*buf = xfer->wvec[seg - 1].buf; return xfer->wvec[seg - 1].len;}
+	*buf = xfer->wbuf;
+	return xfer->wlen;
+}
+
+/// @brief Counts the bytes in the write phase of a transfer
+/// @param xfer Transfer Descriptor
+/// @return uint32_t number of bytes written after the Address
+static uint32_t i2c_wtotal(const i2c_xfer_t *xfer)
 {
-	i2c_err_t i2c_err = i2c_error();
-	if(i2c_err == I2C_OK) i2c_err = I2C_ERR_BUSY;
-	return i2c_err;
+	uint32_t total = xfer->reg_len + xfer->wlen;
+	for(uint8_t seg = 0; seg < xfer->wvec_len; seg++) total += xfer->wvec[seg].len;
+	return total;
 }
 
+/// @brief Stores payload byte [idx] of a read. Streamed reads fill rbuf as
+/// a ring, and hand it to on_chunk when it is full or the payload is done
+/// @param xfer Transfer Descriptor
+/// @param idx number of the byte in the payload
+/// @param byte the byte read
+/// @return uint8_t, 0 once on_chunk has asked for the read to end
+static uint8_t i2c_rx_byte(i2c_xfer_t *xfer, const uint16_t idx, const uint8_t byte)
+{
+	if(!xfer->rchunk) {xfer->rbuf[idx] = byte; return 1;}
 
+	if(idx == 0) xfer->rfill = 0;
+	xfer->rbuf[xfer->rfill++] = byte;
+	if(xfer->rfill < xfer->rchunk && idx + 1 < xfer->rlen) return 1;
 
-/*** API Functions ***********************************************************/
-i2c_err_t i2c_init(uint32_t clk_rate)
+	uint16_t fill = xfer->rfill;
+	xfer->rfill = 0;
+	// No one to hand it to, the ring is just written over
+	if(xfer->on_chunk == NULL) return 1;
+	return xfer->on_chunk(xfer, xfer->rbuf, fill) || idx + 1 == xfer->rlen;
+}
+
+#ifdef I2C_USE_SPEEDS
+/// @brief Finds the speed table entry of a device. The same address on two
+/// busses is two devices, with an entry each
+/// @param bus Bus the device is on
+/// @param addr 7 Bit Device Address, 0 finds a free slot
+/// @return i2c_speed_t *, NULL if the device runs at the bus clock
+static i2c_speed_t *i2c_speed_find(const i2c_bus_t *bus, const uint8_t addr)
 {
-	// Toggle the I2C Reset bit to init Registers
-	RCC->APB1PRSTR |=  RCC_APB1Periph_I2C1;
-	RCC->APB1PRSTR &= ~RCC_APB1Periph_I2C1;
+	for(uint8_t s = 0; s < I2C_SPEED_SLOTS; s++)
+	{
+		if(i2c_speeds[s].addr != addr) continue;
+		if(addr == 0 || i2c_speeds[s].bus == bus) return &i2c_speeds[s];
+	}
+	return NULL;
+}
+#endif
 
-	// Enable the I2C Peripheral Clock
-	RCC->APB1PCENR |= RCC_APB1Periph_I2C1;
+/// @brief Works out the SysTick budget of a transfer
+/// @param xfer Transfer Descriptor
+/// @return uint32_t number of SysTick ticks the transfer may take
+static uint32_t i2c_budget(const i2c_xfer_t *xfer)
+{
+	if(xfer->timeout_us) return Ticks_from_Us(xfer->timeout_us);
+
+	// Timeouts and byte times of the bus the transfer runs on
+	const i2c_bus_t *bus = (xfer->bus != NULL) ? xfer->bus : i2c_bus;
+	uint32_t base_us = bus->timeout_us ? bus->timeout_us : I2C_TIMEOUT_US;
+
+	uint32_t byte_ticks = bus->byte_ticks;
+	#ifdef I2C_USE_SPEEDS
+	// Hardware busses run the device at its own clock
+	const i2c_speed_t *speed = i2c_speed_find(bus, xfer->addr);
+	#ifdef I2C_USE_SOFT
+	if(bus->soft) speed = NULL;
+	#endif
+	if(speed != NULL) byte_ticks = speed->byte_ticks;
+	#endif
+
+	uint32_t bytes = 1 + i2c_wtotal(xfer) + (xfer->rlen ? xfer->rlen + 1 : 0);
+	return Ticks_from_Us(base_us) + (bytes * I2C_TIMEOUT_BYTES * byte_ticks);
+}
 
-	// Enable the selected I2C Port, and the Alternate Function enable bit
-	RCC->APB2PCENR |= I2C_PORT_RCC | RCC_APB2Periph_AFIO;
+/// @brief Checks whether a SysTick deadline has passed. Wrap safe
+/// @param deadline SysTick->CNT value to compare against
+/// @return 1 if the deadline has passed
+__attribute__((always_inline))
+static inline uint32_t i2c_expired(const uint32_t deadline)
+{
+	return (int32_t)(SysTick->CNT - deadline) >= 0;
+}
 
-	// Reset the AFIO_PCFR1 register, then set it up
-	AFIO->PCFR1 &= ~(0x04400002);
-	AFIO->PCFR1 |= I2C_AFIO_REG;
+/// @brief Masks all Interrupts, for a short critical section that may be
+/// entered from an Interrupt handler as well as from the main loop
+/// @param None
+/// @return uint8_t, whether Interrupts were enabled, for i2c_irq_restore
+__attribute__((always_inline))
+static inline uint8_t i2c_irq_mask(void)
+{
+	uint8_t enabled = __isenabled_irq();
+	__disable_irq();
+	return enabled;
+}
 
-	// Clear, then set the GPIO Settings for SCL and SDA, on the selected port
-	I2C_PORT->CFGLR &= ~(0x0F << (4 * I2C_PIN_SDA));
-	I2C_PORT->CFGLR |= (GPIO_Speed_10MHz | GPIO_CNF_OUT_OD_AF) << (4 * I2C_PIN_SDA);	
-	I2C_PORT->CFGLR &= ~(0x0F << (4 * I2C_PIN_SCL));
-	I2C_PORT->CFGLR |= (GPIO_Speed_10MHz | GPIO_CNF_OUT_OD_AF) << (4 * I2C_PIN_SCL);
+/// @brief Ends a critical section started with i2c_irq_mask
+/// @param enabled value returned by i2c_irq_mask
+/// @return None
+__attribute__((always_inline))
+static inline void i2c_irq_restore(const uint8_t enabled)
+{
+	if(enabled) __enable_irq();
+}
 
-	// Set the Prerate frequency
-	uint16_t i2c_conf = I2C1->CTLR2 & ~I2C_CTLR2_FREQ;
-	i2c_conf |= (FUNCONF_SYSTEM_CORE_CLOCK / I2C_PRERATE) & I2C_CTLR2_FREQ;
-	I2C1->CTLR2 = i2c_conf;
+#ifdef I2C_USE_SPEEDS
+/// @brief Keeps the slower of a device and the slowest found so far, to
+/// run a chain at the clock of its slowest link
+/// @param bus Bus the device is on
+/// @param addr 7 Bit Device Address
+/// @param rate slowest clock so far in Hz, start at 0xFFFFFFFF
+/// @param ckcfgr CKCFGR of [rate]
+/// @return None
+static void i2c_speed_slowest(const i2c_bus_t *bus, const uint8_t addr,
+                              uint32_t *rate, uint16_t *ckcfgr)
+{
+	const i2c_speed_t *speed = i2c_speed_find(bus, addr);
+	uint32_t clk_rate = (speed != NULL) ? speed->clk_rate : bus->clk_rate;
+	if(clk_rate >= *rate) return;
 
-	// Set I2C Clock
-	if(clk_rate <= 100000)
-	{
-		i2c_conf = (FUNCONF_SYSTEM_CORE_CLOCK / (2 * clk_rate)) & I2C_CKCFGR_CCR;
-	} else {
-		// Fast mode. Default to 33% Duty Cycle
-		i2c_conf = (FUNCONF_SYSTEM_CORE_CLOCK / (3 * clk_rate)) & I2C_CKCFGR_CCR;
-		i2c_conf |= I2C_CKCFGR_FS;
-	}
-	I2C1->CKCFGR = i2c_conf;
+	*rate   = clk_rate;
+	*ckcfgr = (speed != NULL) ? speed->ckcfgr : bus->ckcfgr;
+}
 
-	// Enable the I2C Peripheral
+/// @brief Loads the CKCFGR of the device a transfer is for, if it is not
+/// loaded already, so only changes of speed cost anything. The first link
+/// of a chain loads the clock of the slowest link instead. The transfer's
+/// bus must already be selected
+/// @param addr 7 Bit Device Address
+/// @return None
+static void i2c_speed_apply(const uint8_t addr)
+{
+	#ifdef I2C_USE_SOFT
+	// Software busses run at their own clock, and leave I2C1 alone
+	if(i2c_bus->soft) return;
+	#endif
+
+	const i2c_speed_t *speed = i2c_speed_find(i2c_bus, addr);
+	uint16_t ckcfgr = (speed != NULL) ? speed->ckcfgr : i2c_hw->ckcfgr;
+	if(i2c_speed_hold != 0) ckcfgr = i2c_speed_hold;
+	if(I2C1->CKCFGR == ckcfgr) return;
+
+	// A chain keeps the bus between links, PE can not be dropped. It runs
+	// at the clock its first link loaded, that of its slowest link
+	if(I2C1->STAR2 & I2C_STAR2_MSL) return;
+
+	uint32_t start = SysTick->CNT;
+
+	// A STOP from the last transfer must be out before PE is cleared, and
+	// CKCFGR can only be written while the Peripheral is disabled
+	uint32_t deadline = start + Ticks_from_Us(I2C_TIMEOUT_US);
+	while((I2C1->CTLR1 & I2C_CTLR1_STOP) && !i2c_expired(deadline));
+	I2C1->CTLR1 &= ~I2C_CTLR1_PE;
+	I2C1->CKCFGR = ckcfgr;
 	I2C1->CTLR1 |= I2C_CTLR1_PE;
 
-	//TODO:
-	// Check error states
-	if(I2C1->STAR1 & I2C_STAR1_BERR) 
+	i2c_speed_loads++;
+	i2c_speed_ticks += SysTick->CNT - start;
+}
+#define I2C_SPEED_APPLY(addr) i2c_speed_apply(addr)
+#else
+#define I2C_SPEED_APPLY(addr)
+#endif
+
+#ifdef I2C_USE_STATS
+/*** Statistics **************************************************************/
+/// @brief Finds the slot of an address, taking a free one if it has none
+/// @param addr 7 Bit Device Address
+/// @return i2c_stats_t *, the slot. The overflow slot if the table is full
+static i2c_stats_t *i2c_stats_slot(const uint8_t addr)
+{
+	for(uint8_t s = 0; s < I2C_STATS_SLOTS; s++)
 	{
-		I2C1->STAR1 &= ~(I2C_STAR1_BERR); 
-		return I2C_ERR_BERR;
+		if(i2c_stats[s].addr == addr) return &i2c_stats[s];
+		if(i2c_stats[s].addr == 0) {i2c_stats[s].addr = addr; return &i2c_stats[s];}
 	}
 
-	return I2C_OK;
+	i2c_stats[I2C_STATS_SLOTS].addr = I2C_STATS_OTHER;
+	return &i2c_stats[I2C_STATS_SLOTS];
 }
 
+/// @brief Counts one finished attempt at a transfer
+/// @param xfer Transfer Descriptor
+/// @param err result of the attempt
+/// @param ticks SysTick ticks the attempt took
+/// @return None
+static void i2c_stats_record(const i2c_xfer_t *xfer, const i2c_err_t err,
+                             const uint32_t ticks)
+{
+	if(i2c_stats_paused) return;
+	i2c_stats_t *st = i2c_stats_slot(xfer->addr);
+
+	st->xfers++;
+	switch(err)
+	{
+		case I2C_OK:
+			st->wbytes += i2c_wtotal(xfer);
+			st->rbytes += xfer->rlen;
+			break;
+		case I2C_ERR_NACK:    st->nack++;    break;
+		case I2C_ERR_ARLO:    st->arlo++;    break;
+		case I2C_ERR_TIMEOUT: st->timeout++; break;
+		default:              st->other++;   break;
+	}
+
+	st->ticks_sum += ticks;
+	if(ticks > st->ticks_max) st->ticks_max = ticks;
 
-i2c_err_t i2c_ping(const uint8_t addr)
+	// Bin 0 is under 64us, then one bin per doubling
+	uint32_t us = (ticks / DELAY_US_TIME) >> 6;
+	uint8_t bin = 0;
+	while(us && bin < I2C_STATS_BINS - 1) {us >>= 1; bin++;}
+	st->hist[bin]++;
+}
+
+#define I2C_STATS_RECORD(xfer, err, ticks) i2c_stats_record(xfer, err, ticks)
+#define I2C_STATS_RETRY(xfer) \
+	do { if(!i2c_stats_paused) i2c_stats_slot((xfer)->addr)->retries++; } while(0)
+#define I2C_STATS_PAUSE(p) (i2c_stats_paused = (p))
+#else
+#define I2C_STATS_RECORD(xfer, err, ticks)
+#define I2C_STATS_RETRY(xfer)
+#define I2C_STATS_PAUSE(p)
+#endif
+
+
+#ifdef I2C_USE_WFI
+/// @brief Sleeps in WFI until an enabled Interrupt is pending, or SysTick
+/// reaches [deadline]. Must be called with Interrupts disabled, so an event
+/// between the caller's last check and the WFI still wakes it up. Pending
+/// handlers run once the caller enables Interrupts again
+/// @param deadline SysTick value to wake up at, at the latest
+/// @return None
+static void i2c_sleep(const uint32_t deadline)
 {
-	i2c_err_t i2c_ret = I2C_OK;
+	uint32_t start = SysTick->CNT;
 
-	// Wait for the bus to become not busy - return I2C_ERR_TIMEOUT on failure
-	int32_t timeout = I2C_TIMEOUT;
-	while(I2C1->STAR2 & I2C_STAR2_BUSY) 
-		if(--timeout < 0) i2c_ret = I2C_ERR_BUSY;
+	// The SysTick compare is the wake-up alarm
+	SysTick->CMP   = deadline;
+	SysTick->SR    = 0;
+	SysTick->CTLR |= SYSTICK_CTLR_STIE;
+	NVIC_EnableIRQ(SysTicK_IRQn);
 
-	if(i2c_ret == I2C_OK)
-	{
-		// Send a START Signal and wait for it to assert
-		I2C1->CTLR1 |= I2C_CTLR1_START;
-		while(!i2c_status(I2C_EVENT_MASTER_MODE_SELECT));
+	if(!i2c_expired(deadline)) __WFI();
 
-		// Send the Address and wait for it to finish transmitting
-		timeout = I2C_TIMEOUT;
-		I2C1->DATAR = (addr << 1) & 0xFE;
-		// If the device times out, get the error status - if status is okay,
-		// return generic I2C_ERR_BUSY Flag
-		while(!i2c_status(I2C_EVENT_MASTER_TRANSMITTER_MODE_SELECTED))
-			if(--timeout < 0) {i2c_ret = i2c_get_busy_error(); break;}
-	}
+	SysTick->CTLR &= ~SYSTICK_CTLR_STIE;
+	SysTick->SR    = 0;
+	NVIC_DisableIRQ(SysTicK_IRQn);
+	NVIC_ClearPendingIRQ(SysTicK_IRQn);
 
-	// Send the STOP Signal, return i2c status
-	I2C1->CTLR1 |= I2C_CTLR1_STOP;
-	return i2c_ret;
+	i2c_slept += SysTick->CNT - start;
 }
+#endif
 
 
-void i2c_scan(void (*callback)(const uint8_t))
+#ifndef I2C_USE_IRQ
+#ifdef I2C_USE_WFI
+/// @brief Sleeps until I2C1 raises one of the [sources] Interrupts, or the
+/// transfer deadline passes. Only the pending flags are used to wake up,
+/// the I2C handlers never run
+/// @param sources I2C_CTLR2_IT* Interrupt sources to wake up on
+/// @return None
+static void i2c_sleep_on(const uint16_t sources)
 {
-	// If the callback function is null, exit
-	if(callback == NULL) return;
+	uint8_t irq = i2c_irq_mask();
+	I2C1->CTLR2 |= sources;
+	NVIC_EnableIRQ(I2C1_EV_IRQn);
+	NVIC_EnableIRQ(I2C1_ER_IRQn);
+
+	i2c_sleep(i2c_deadline);
+
+	I2C1->CTLR2 &= ~(I2C_CTLR2_ITEVTEN | I2C_CTLR2_ITBUFEN | I2C_CTLR2_ITERREN);
+	NVIC_DisableIRQ(I2C1_EV_IRQn);
+	NVIC_DisableIRQ(I2C1_ER_IRQn);
+	NVIC_ClearPendingIRQ(I2C1_EV_IRQn);
+	NVIC_ClearPendingIRQ(I2C1_ER_IRQn);
+	i2c_irq_restore(irq);
+}
 
-	// Scan through every address, getting a ping() response
-	for(uint8_t addr = 0x00; addr < 0x7F; addr++)
+// Spins for the first part of a wait, then sleeps if the bus allows it
+#define I2C_WAIT_START() \
+	const uint32_t spin = SysTick->CNT + i2c_bus->byte_ticks / I2C_WFI_SPIN_DIV
+#define I2C_WAIT_IDLE(sources) \
+	do { if(i2c_bus->sleep && i2c_expired(spin)) i2c_sleep_on(sources); } while(0)
+#else
+#define I2C_WAIT_START()
+#define I2C_WAIT_IDLE(sources)
+#endif
+
+/// @brief Waits for a 32 bit STAR1/STAR2 event. Returns early on any error
+/// flag, or I2C_ERR_TIMEOUT once the transfer deadline passes
+/// @param event I2C_EVENT_* to wait for
+/// @return i2c_err_t, I2C_OK once the event happened
+static i2c_err_t i2c_wait_event(const uint32_t event)
+{
+	I2C_WAIT_START();
+	while(!i2c_status(event))
 	{
-		// If the address responds, call the callback function
-		if(i2c_ping(addr) == I2C_OK) callback(addr);
+		if(I2C1->STAR1 & I2C_STAR1_ERRORS) return i2c_error();
+		if(i2c_expired(i2c_deadline)) return I2C_ERR_TIMEOUT;
+		// SB, ADDR and BTF are event Interrupts, TXE would wake it too early
+		I2C_WAIT_IDLE(I2C_CTLR2_ITEVTEN | I2C_CTLR2_ITERREN);
 	}
+	return I2C_OK;
 }
 
-
-i2c_err_t i2c_read(const uint8_t addr, const uint8_t reg, uint8_t *buf, const uint8_t len)
+/// @brief Waits for a STAR1 flag, same rules as i2c_wait_event
+/// @param flag I2C_STAR1_TXE or I2C_STAR1_RXNE to wait for
+/// @return i2c_err_t, I2C_OK once the flag is set
+static i2c_err_t i2c_wait_flag(const uint16_t flag)
 {
-	i2c_err_t i2c_ret = I2C_OK;
+	I2C_WAIT_START();
+	while(!(I2C1->STAR1 & flag))
+	{
+		if(I2C1->STAR1 & I2C_STAR1_ERRORS) return i2c_error();
+		if(i2c_expired(i2c_deadline)) return I2C_ERR_TIMEOUT;
+		I2C_WAIT_IDLE(I2C_CTLR2_ITEVTEN | I2C_CTLR2_ITBUFEN | I2C_CTLR2_ITERREN);
+	}
+	return I2C_OK;
+}
+#endif
+
+
+#ifdef I2C_USE_DMA
+/// @brief Points a DMA1 Channel at the I2C Data Register and starts it
+/// @param chan DMA1_Channel6 (TX) or DMA1_Channel7 (RX)
+/// @param buf memory buffer to transfer to/from
+/// @param len number of bytes to transfer
+/// @param dir DMA_CFGR1_DIR for Memory -> I2C, 0 for I2C -> Memory
+/// @return None
+static void i2c_dma_start(DMA_Channel_TypeDef *chan, uint8_t *buf,
+                          const uint16_t len, const uint32_t dir)
+{
+	chan->CFGR  = 0;
+	chan->PADDR = (uint32_t)&I2C1->DATAR;
+	chan->MADDR = (uint32_t)buf;
+	chan->CNTR  = len;
+	chan->CFGR  = DMA_CFGR1_MINC | DMA_CFGR1_PL | dir | DMA_CFGR1_EN;
+}
 
-	// Wait for the bus to become not busy - set state to I2C_ERR_TIMEOUT on failure
-	int32_t timeout = I2C_TIMEOUT;
-	while(I2C1->STAR2 & I2C_STAR2_BUSY) 
-		if(--timeout < 0) {i2c_ret = i2c_get_busy_error(); break;}
-	
-	if(i2c_ret == I2C_OK)
+/// @brief Waits for a DMA Transfer Complete flag, an I2C Error or the deadline
+/// @param tc_flag DMA_TCIF6 or DMA_TCIF7
+/// @return i2c_err_t, I2C_OK when the channel finished
+static i2c_err_t i2c_dma_wait(const uint32_t tc_flag)
+{
+	while(!(DMA1->INTFR & tc_flag))
 	{
-		// Send a START Signal and wait for it to assert
-		I2C1->CTLR1 |= I2C_CTLR1_START;
-		while(!i2c_status(I2C_EVENT_MASTER_MODE_SELECT));
+		if(I2C1->STAR1 & I2C_STAR1_ERRORS) return i2c_error();
+		if(i2c_expired(i2c_deadline)) return I2C_ERR_TIMEOUT;
 
-		// Send the Address and wait for it to finish transmitting
-		timeout = I2C_TIMEOUT;
-		I2C1->DATAR = (addr << 1) & 0xFE;
-		while(!i2c_status(I2C_EVENT_MASTER_TRANSMITTER_MODE_SELECTED))
-			if(--timeout < 0) {i2c_ret = i2c_get_busy_error(); break;}
+		I2C_DMA_WAIT_HOOK();
 	}
+	return I2C_OK;
+}
 
-	if(i2c_ret == I2C_OK)
-	{
-		
-		// Send the Register Byte or just low byte
-		I2C1->DATAR = reg ;
-		while(!(I2C1->STAR1 & I2C_STAR1_TXE));
-		
-		
-		// If the message is long enough, enable ACK messages
-		if(len > 1) I2C1->CTLR1 |= I2C_CTLR1_ACK;
+/// @brief Stops both I2C DMA Channels and clears their flags
+/// @param None
+/// @return None
+static void i2c_dma_stop(void)
+{
+	I2C1->CTLR2 &= ~(I2C_CTLR2_DMAEN | I2C_CTLR2_LAST);
+	DMA1_Channel6->CFGR = 0;
+	DMA1_Channel7->CFGR = 0;
+	DMA1->INTFCR = DMA1_Channel6_IT_Mask | DMA1_Channel7_IT_Mask;
+}
 
-		// Send a Repeated START Signal and wait for it to assert
-		I2C1->CTLR1 |= I2C_CTLR1_START;
-		while(!i2c_status(I2C_EVENT_MASTER_MODE_SELECT));
+/// @brief Arms the RX DMA Channel. Must happen before the Read Address is
+/// sent, so the first RXNE already raises a DMA request. LAST makes the
+/// peripheral NACK the final byte on its own
+/// @param buf buffer to read into
+/// @param len number of bytes to read. Must be 2 or more
+/// @return None
+static void i2c_dma_rx_arm(uint8_t *buf, const uint16_t len)
+{
+	i2c_dma_start(DMA1_Channel7, buf, len, 0);
+	I2C1->CTLR2 |= I2C_CTLR2_DMAEN | I2C_CTLR2_LAST;
+}
+#endif
 
-		// Send Read Address
-		timeout = I2C_TIMEOUT;
-		I2C1->DATAR = (addr << 1) | 0x01;
-		while(!i2c_status(I2C_EVENT_MASTER_RECEIVER_MODE_SELECTED))
-			if(--timeout < 0) {i2c_ret = i2c_get_busy_error(); break;}
 
-		
-	}
+#ifndef I2C_USE_IRQ
+/// @brief Sends a START (or repeated START) and an Address byte, then waits
+/// for the Slave to ACK it
+/// @param addr_rw 7 Bit Address shifted left, with the R/W Bit set for reads
+/// @return i2c_err_t, I2C_OK if the Slave responded
+static i2c_err_t i2c_start(const uint8_t addr_rw)
+{
+	// Send a START Signal and wait for it to assert
+	I2C1->CTLR1 |= I2C_CTLR1_START;
+	i2c_err_t i2c_ret = i2c_wait_event(I2C_EVENT_MASTER_MODE_SELECT);
+	if(i2c_ret != I2C_OK) return i2c_ret;
+
+	// Send the Address and wait for it to finish transmitting
+	const uint32_t event = (addr_rw & 0x01) ? I2C_EVENT_MASTER_RECEIVER_MODE_SELECTED
+	                                        : I2C_EVENT_MASTER_TRANSMITTER_MODE_SELECTED;
+	I2C1->DATAR = addr_rw;
+	return i2c_wait_event(event);
+}
+
+/// @brief Writes bytes of a transfer, the Address must already have been sent
+/// @param buf buffer to write from
+/// @param len number of bytes to write
+/// @return i2c_err_t, I2C_OK on success
+static i2c_err_t i2c_write_payload(const uint8_t *buf, const uint16_t len)
+{
+	i2c_err_t i2c_ret = I2C_OK;
 
-	if(i2c_ret == I2C_OK)
+	#ifdef I2C_USE_DMA
+	// The PEC byte has to be asked for after the last byte, so PEC transfers
+	// are not handed to DMA
+	if(len >= I2C_DMA_THRESHOLD && !(I2C1->CTLR1 & I2C_CTLR1_ENPEC))
+	{
+		if((i2c_ret = i2c_wait_flag(I2C_STAR1_TXE)) != I2C_OK) return i2c_ret;
+		i2c_dma_start(DMA1_Channel6, (uint8_t *)buf, len, DMA_CFGR1_DIR);
+		I2C1->CTLR2 |= I2C_CTLR2_DMAEN;
+		i2c_ret = i2c_dma_wait(DMA_TCIF6);
+		i2c_dma_stop();
+	} else
+	#endif
 	{
-		// Read bytes
-		uint8_t cbyte = 0;
+		// Write bytes
+		uint16_t cbyte = 0;
 		while(cbyte < len)
 		{
-			// If this is the last byte, send the NACK Bit
-			if(cbyte == len - 1) I2C1->CTLR1 &= ~I2C_CTLR1_ACK;
-
-			// Wait until the Read Register isn't empty
-			while(!(I2C1->STAR1 & I2C_STAR1_RXNE));
-			buf[cbyte] = I2C1->DATAR;
-
-			// Make sure no errors occured
-			if((i2c_ret = i2c_error()) != I2C_OK) break;
+			// Wait for room in the Data Register, then write the byte
+			if((i2c_ret = i2c_wait_flag(I2C_STAR1_TXE)) != I2C_OK) break;
+			I2C1->DATAR = buf[cbyte];
 
 			++cbyte;
 		}
 	}
 
-	// Send the STOP Condition to auto-reset for the next operation
-	I2C1->CTLR1 |= I2C_CTLR1_STOP;
-
 	return i2c_ret;
 }
 
-/* read i2c data from a device using 2 bytes as register address */
-i2c_err_t i2c_read_2ba(const uint8_t addr,	const uint8_t reglow, const uint8_t reghi,
-											uint8_t *buf,
-											const uint8_t len)
+/// @brief Reads the payload of a transfer, the Read Address must already
+/// have been sent. If the RX DMA was armed, only waits for it to finish
+/// @param xfer Transfer Descriptor, its rbuf is read into
+/// @return i2c_err_t, I2C_OK on success
+static i2c_err_t i2c_read_payload(i2c_xfer_t *xfer)
 {
+	const uint16_t len = xfer->rlen;
 	i2c_err_t i2c_ret = I2C_OK;
 
-	// Wait for the bus to become not busy - set state to I2C_ERR_TIMEOUT on failure
-	int32_t timeout = I2C_TIMEOUT;
-	while(I2C1->STAR2 & I2C_STAR2_BUSY) 
-		if(--timeout < 0) {i2c_ret = i2c_get_busy_error(); break;}
-	
-	if(i2c_ret == I2C_OK)
+	#ifdef I2C_USE_DMA
+	if(I2C1->CTLR2 & I2C_CTLR2_DMAEN)
 	{
-		// Send a START Signal and wait for it to assert
-		I2C1->CTLR1 |= I2C_CTLR1_START;
-		while(!i2c_status(I2C_EVENT_MASTER_MODE_SELECT));
-
-		// Send the Address and wait for it to finish transmitting
-		timeout = I2C_TIMEOUT;
-		I2C1->DATAR = (addr << 1) & 0xFE;
-		while(!i2c_status(I2C_EVENT_MASTER_TRANSMITTER_MODE_SELECTED))
-			if(--timeout < 0) {i2c_ret = i2c_get_busy_error(); break;}
+		i2c_ret = i2c_dma_wait(DMA_TCIF7);
+		i2c_dma_stop();
+		return i2c_ret;
 	}
+	#endif
 
-	if(i2c_ret == I2C_OK)
-	{
-		// Send high byte
-		// Send the Register Byte
-		I2C1->DATAR = reghi;
-		while(!(I2C1->STAR1 & I2C_STAR1_TXE));
-		I2C1->DATAR = reglow;
-		while(!(I2C1->STAR1 & I2C_STAR1_TXE));
-		
-		
-		// If the message is long enough, enable ACK messages
-		if(len > 1) I2C1->CTLR1 |= I2C_CTLR1_ACK;
+	// With PEC on, the byte after the payload is the PEC, which the
+	// hardware checks against its own
+	uint16_t total = len + ((I2C1->CTLR1 & I2C_CTLR1_ENPEC) ? 1 : 0);
+	uint16_t keep  = len;
 
-		// Send a Repeated START Signal and wait for it to assert
-		I2C1->CTLR1 |= I2C_CTLR1_START;
-		while(!i2c_status(I2C_EVENT_MASTER_MODE_SELECT));
+	// Read bytes
+	uint16_t cbyte = 0;
+	while(cbyte < total)
+	{
+		// If this is the last byte, send the NACK Bit
+		if(cbyte == total - 1)
+		{
+			I2C1->CTLR1 &= ~I2C_CTLR1_ACK;
+			if(cbyte == len) I2C1->CTLR1 |= I2C_CTLR1_PEC;
+		}
 
-		// Send Read Address
-		timeout = I2C_TIMEOUT;
-		I2C1->DATAR = (addr << 1) | 0x01;
-		while(!i2c_status(I2C_EVENT_MASTER_RECEIVER_MODE_SELECTED))
-			if(--timeout < 0) {i2c_ret = i2c_get_busy_error(); break;}
+		// Wait until the Read Register isn't empty
+		if((i2c_ret = i2c_wait_flag(I2C_STAR1_RXNE)) != I2C_OK) break;
+		uint8_t byte = I2C1->DATAR;
+		if(cbyte < keep && !i2c_rx_byte(xfer, cbyte, byte))
+		{
+			// Streamed read ended early. The next byte is already coming,
+			// NACK it and drop it. If on_chunk took longer than a byte,
+			// that one was ACKed and the one after it is NACKed instead
+			keep = cbyte + 1;
+			if(cbyte + 2 < total) total = cbyte + 2;
+		}
 
-		
+		++cbyte;
 	}
 
-	if(i2c_ret == I2C_OK)
+	// A PEC mismatch is flagged with the last byte
+	if(i2c_ret == I2C_OK && (I2C1->STAR1 & I2C_STAR1_PECERR)) i2c_ret = i2c_error();
+	return i2c_ret;
+}
+#endif
+
+
+#ifdef I2C_USE_IRQ
+/*** Interrupt Engine ********************************************************/
+// Transfer phases of the running transfer
+#define I2C_PHASE_WRITE  0   // Address + Register prefix + write payload
+#define I2C_PHASE_READ   1   // Read Address + read payload
+
+// Ring of submitted transfers. head is the next to run, tail the next free
+static i2c_xfer_t *i2c_queue[I2C_QUEUE_LEN];
+static volatile uint8_t i2c_q_head, i2c_q_tail;
+
+// Running transfer state
+static i2c_xfer_t *volatile i2c_cur;
+static uint8_t  i2c_phase;
+static uint16_t i2c_idx;
+// Bytes to read, with the PEC, and payload bytes to keep. Cut short when
+// a streamed read is ended early
+static uint16_t i2c_rend, i2c_rkeep;
+
+#ifdef I2C_USE_PEC
+// Set once the PEC byte of the write phase has been asked for
+static uint8_t i2c_pec_sent;
+#endif
+
+// Write segment being sent, see i2c_wseg()
+static uint8_t        i2c_seg;
+static const uint8_t *i2c_seg_buf;
+static uint16_t       i2c_seg_len;
+
+// SysTick values the running transfer started at, and must be done by
+static uint32_t i2c_cur_start, i2c_cur_deadline;
+
+#ifdef I2C_USE_SPEEDS
+/// @brief Holds the clock of the slowest link when the running transfer
+/// starts a chain. Its links are queued together, right behind it
+/// @param None
+/// @return None
+static void i2c_speed_hold_chain(void)
+{
+	// Later links of a chain keep the clock the first one loaded
+	if(I2C1->STAR2 & I2C_STAR2_MSL) return;
+
+	i2c_speed_hold = 0;
+	if(!(i2c_cur->flags & I2C_XFER_NOSTOP)) return;
+
+	uint32_t rate = 0xFFFFFFFF;
+	uint16_t ckcfgr = 0;
+	const i2c_xfer_t *link = i2c_cur;
+	for(uint8_t q = i2c_q_head; ; q = (q + 1) & (I2C_QUEUE_LEN - 1))
 	{
-		// Read bytes
-		uint8_t cbyte = 0;
-		while(cbyte < len)
-		{
-			// If this is the last byte, send the NACK Bit
-			if(cbyte == len - 1) I2C1->CTLR1 &= ~I2C_CTLR1_ACK;
+		i2c_speed_slowest(i2c_bus, link->addr, &rate, &ckcfgr);
+		if(!(link->flags & I2C_XFER_NOSTOP) || q == i2c_q_tail) break;
+		link = i2c_queue[q];
+	}
+	i2c_speed_hold = ckcfgr;
+}
+#define I2C_SPEED_HOLD_CHAIN() i2c_speed_hold_chain()
+#else
+#define I2C_SPEED_HOLD_CHAIN()
+#endif
+
+/// @brief Pops the next queued transfer, if any, and sends its START
+/// Must be called with the I2C Interrupts unable to fire
+/// @param None
+/// @return None
+static void i2c_irq_next(void)
+{
+	if(i2c_q_head == i2c_q_tail) {i2c_cur = NULL; return;}
 
-			// Wait until the Read Register isn't empty
-			while(!(I2C1->STAR1 & I2C_STAR1_RXNE));
-			buf[cbyte] = I2C1->DATAR;
+	i2c_cur = i2c_queue[i2c_q_head];
+	i2c_q_head = (i2c_q_head + 1) & (I2C_QUEUE_LEN - 1);
+	i2c_idx = 0;
 
-			// Make sure no errors occured
-			if((i2c_ret = i2c_error()) != I2C_OK) break;
+	// Read-only transfers go straight to the Read Address
+	i2c_seg = 0;
+	i2c_seg_len = i2c_wseg(i2c_cur, 0, &i2c_seg_buf);
 
-			++cbyte;
-		}
-	}
+	if(i2c_cur->rlen && !i2c_wtotal(i2c_cur)) i2c_phase = I2C_PHASE_READ;
+	else                                      i2c_phase = I2C_PHASE_WRITE;
 
-	// Send the STOP Condition to auto-reset for the next operation
-	I2C1->CTLR1 |= I2C_CTLR1_STOP;
+	// A STOP from the last transfer must be out before the next START
+	uint32_t deadline = SysTick->CNT + Ticks_from_Us(I2C_TIMEOUT_US);
+	while((I2C1->CTLR1 & I2C_CTLR1_STOP) && !i2c_expired(deadline));
 
-	return i2c_ret;
+	if(i2c_cur->bus != NULL) i2c_bus_select(i2c_cur->bus);
+	I2C_SPEED_HOLD_CHAIN();
+	I2C_SPEED_APPLY(i2c_cur->addr);
+	I2C_PEC_BEGIN(i2c_cur);
+	#ifdef I2C_USE_PEC
+	i2c_pec_sent = 0;
+	#endif
+
+	// Each transfer is timed from its own START, not from when it was queued
+	i2c_cur_start    = SysTick->CNT;
+	i2c_cur_deadline = i2c_cur_start + i2c_budget(i2c_cur);
+
+	I2C1->CTLR2 |= I2C_CTLR2_ITEVTEN | I2C_CTLR2_ITBUFEN | I2C_CTLR2_ITERREN;
+	I2C1->CTLR1 |= I2C_CTLR1_START;
 }
 
+/// @brief Finishes the running transfer and reports it, without starting
+/// the next one
+/// @param err, result of the transfer
+/// @return None
+static void i2c_irq_finish_only(const i2c_err_t err)
+{
+	i2c_xfer_t *xfer = i2c_cur;
+	i2c_cur = NULL;
+
+	I2C1->CTLR2 &= ~(I2C_CTLR2_ITEVTEN | I2C_CTLR2_ITBUFEN | I2C_CTLR2_ITERREN);
+	I2C_STATS_RECORD(xfer, err, SysTick->CNT - i2c_cur_start);
+
+	xfer->err  = err;
+	xfer->busy = 0;
+	if(xfer->callback != NULL) xfer->callback(xfer);
+}
 
-i2c_err_t i2c_write(const uint8_t addr,	const uint8_t reg, const uint8_t *buf, const uint8_t len)
+/// @brief Finishes the running transfer, reports it and starts the next
+/// @param err, result of the transfer
+/// @return None
+static void i2c_irq_finish(const i2c_err_t err)
 {
-	i2c_err_t i2c_ret = I2C_OK;
+	uint8_t chained = i2c_cur->flags & I2C_XFER_NOSTOP;
+	i2c_irq_finish_only(err);
+
+	// A failed link of a chain takes the rest of the chain down with it,
+	// the STOP has already ended it on the bus
+	while(err != I2C_OK && chained && i2c_cur == NULL && i2c_q_head != i2c_q_tail)
+	{
+		i2c_cur = i2c_queue[i2c_q_head];
+		i2c_q_head = (i2c_q_head + 1) & (I2C_QUEUE_LEN - 1);
+		chained = i2c_cur->flags & I2C_XFER_NOSTOP;
+		i2c_irq_finish_only(err);
+	}
+
+	if(i2c_cur == NULL) i2c_irq_next();
+}
 
-	// Wait for the bus to become not busy - set state to I2C_ERR_TIMEOUT on failure
-	int32_t timeout = I2C_TIMEOUT;
-	while(I2C1->STAR2 & I2C_STAR2_BUSY) 
-		if(--timeout < 0) {i2c_ret = i2c_get_busy_error(); break;}
-	if(i2c_ret == I2C_OK)
+/// @brief Ends the write phase, with a repeated START if there is data to
+/// read, otherwise with a STOP
+/// @param None
+/// @return None
+static void i2c_irq_write_done(void)
+{
+	if(i2c_cur->rlen)
 	{
-		// Send a START Signal and wait for it to assert
+		i2c_phase = I2C_PHASE_READ;
+		i2c_idx = 0;
+		I2C1->CTLR2 |= I2C_CTLR2_ITBUFEN;
 		I2C1->CTLR1 |= I2C_CTLR1_START;
-		while(!i2c_status(I2C_EVENT_MASTER_MODE_SELECT));
-		// Send the Address and wait for it to finish transmitting
-		timeout = I2C_TIMEOUT;
-		I2C1->DATAR = (addr << 1) & 0xFE;
-		while(!i2c_status(I2C_EVENT_MASTER_TRANSMITTER_MODE_SELECTED))
-			if(--timeout < 0) {i2c_ret = i2c_get_busy_error(); break;}
-	}
-	if(i2c_ret == I2C_OK)
-	{
-		// Send the Register Byte 
-		I2C1->DATAR = reg & 0x00FF;
-		while(!(I2C1->STAR1 & I2C_STAR1_TXE));
-		// Write bytes
-		uint8_t cbyte = 0;
-		while(cbyte < len)
-		{
-			// Write the byte and wait for it to finish transmitting
-			while(!(I2C1->STAR1 & I2C_STAR1_TXE));
-			I2C1->DATAR = buf[cbyte];
-			// Make sure no errors occured
-			if((i2c_ret = i2c_error()) != I2C_OK) break;
-			++cbyte;
-		}
-		// Wait for the bus to finish transmitting
-		while(!i2c_status(I2C_EVENT_MASTER_BYTE_TRANSMITTED));
+	} else {
+		if(!(i2c_cur->flags & I2C_XFER_NOSTOP)) I2C1->CTLR1 |= I2C_CTLR1_STOP;
+		i2c_irq_finish(I2C_OK);
 	}
-	// Send a STOP Condition, to aut-reset for the next operation
-	I2C1->CTLR1 |= I2C_CTLR1_STOP;
-	return i2c_ret;
 }
 
-/* write i2c using 2 byte register address */
-i2c_err_t i2c_write_2ba(const uint8_t addr,	const uint8_t reglow, const uint8_t reghi,
-											const uint8_t *buf,
-											const uint8_t len)
+void I2C1_EV_IRQHandler(void) __attribute__((interrupt));
+void I2C1_EV_IRQHandler(void)
 {
-	i2c_err_t i2c_ret = I2C_OK;
+	i2c_xfer_t *xfer = i2c_cur;
+	uint16_t star1 = I2C1->STAR1;
 
-	// Wait for the bus to become not busy - set state to I2C_ERR_TIMEOUT on failure
-	int32_t timeout = I2C_TIMEOUT;
-	while(I2C1->STAR2 & I2C_STAR2_BUSY) 
-		if(--timeout < 0) {i2c_ret = i2c_get_busy_error(); break;}
+	// Nothing to do, make sure the Interrupt stops firing
+	if(xfer == NULL)
+	{
+		I2C1->CTLR2 &= ~(I2C_CTLR2_ITEVTEN | I2C_CTLR2_ITBUFEN);
+		return;
+	}
 
-	if(i2c_ret == I2C_OK)
+	// START sent, send the Address for this phase
+	if(star1 & I2C_STAR1_SB)
 	{
-		// Send a START Signal and wait for it to assert
-		I2C1->CTLR1 |= I2C_CTLR1_START;
-		while(!i2c_status(I2C_EVENT_MASTER_MODE_SELECT));
+		if(i2c_phase == I2C_PHASE_WRITE)
+		{
+			I2C1->DATAR = (xfer->addr << 1) & 0xFE;
+		} else {
+			i2c_rend  = xfer->rlen + I2C_PEC(xfer);
+			i2c_rkeep = xfer->rlen;
 
-		// Send the Address and wait for it to finish transmitting
-		timeout = I2C_TIMEOUT;
-		I2C1->DATAR = (addr << 1) & 0xFE;
-		while(!i2c_status(I2C_EVENT_MASTER_TRANSMITTER_MODE_SELECTED))
-			if(--timeout < 0) {i2c_ret = i2c_get_busy_error(); break;}
+			// NACK the first byte if it is the only byte
+			if(xfer->rlen + I2C_PEC(xfer) > 1) I2C1->CTLR1 |= I2C_CTLR1_ACK;
+			else                               I2C1->CTLR1 &= ~I2C_CTLR1_ACK;
+
+			I2C1->DATAR = (xfer->addr << 1) | 0x01;
+		}
+		return;
 	}
 
+	// Address ACKed. Reading STAR2 after STAR1 clears ADDR
+	if(star1 & I2C_STAR1_ADDR)
+	{
+		(void)I2C1->STAR2;
+
+		if(i2c_phase == I2C_PHASE_READ)
+		{
+			// Single byte reads queue their STOP straight away
+			if(xfer->rlen + I2C_PEC(xfer) == 1 && !(xfer->flags & I2C_XFER_NOSTOP))
+				I2C1->CTLR1 |= I2C_CTLR1_STOP;
+		} else if(i2c_wtotal(xfer) == 0) {
+			// Nothing to write, eg a ping
+			i2c_irq_write_done();
+		}
+		return;
+	}
 
-	if(i2c_ret == I2C_OK)
+	if(i2c_phase == I2C_PHASE_WRITE)
 	{
-		// Send the Register Byte
-		while(!(I2C1->STAR1 & I2C_STAR1_TXE));
-		I2C1->DATAR = reghi;
-		while(!(I2C1->STAR1 & I2C_STAR1_TXE));
-		I2C1->DATAR = reglow;
-		while(!(I2C1->STAR1 & I2C_STAR1_TXE));
-		
-		// Write bytes
-		uint8_t cbyte = 0;
-		while(cbyte < len)
+		if(star1 & I2C_STAR1_TXE)
 		{
-			// Write the byte and wait for it to finish transmitting
-			while(!(I2C1->STAR1 & I2C_STAR1_TXE));
-			I2C1->DATAR = buf[cbyte];
+			// Move on to the next segment with something in it
+			while(i2c_idx == i2c_seg_len && i2c_seg <= xfer->wvec_len)
+			{
+				i2c_seg_len = i2c_wseg(xfer, ++i2c_seg, &i2c_seg_buf);
+				i2c_idx = 0;
+			}
+
+			if(i2c_idx < i2c_seg_len)
+			{
+				I2C1->DATAR = i2c_seg_buf[i2c_idx++];
+				return;
+			}
+		}
+
+		#ifdef I2C_USE_PEC
+		// Everything is queued, the PEC follows unless a read carries it
+		if(I2C_PEC(xfer) && !xfer->rlen && !i2c_pec_sent)
+		{
+			I2C1->CTLR1 |= I2C_CTLR1_PEC;
+			i2c_pec_sent = 1;
+		}
+		#endif
 
-			// Make sure no errors occured
-			if((i2c_ret = i2c_error()) != I2C_OK) break;
+		// Everything is queued. Wait for BTF without TXE firing constantly
+		if(star1 & I2C_STAR1_BTF) i2c_irq_write_done();
+		else I2C1->CTLR2 &= ~I2C_CTLR2_ITBUFEN;
+		return;
+	}
 
-			++cbyte;
+	if(star1 & I2C_STAR1_RXNE)
+	{
+		// With PEC on, the last byte is the PEC, checked by the hardware.
+		// The byte before the last one: NACK and STOP the next (last) one
+		// while it is still being received
+		if(i2c_rend - i2c_idx == 2)
+		{
+			I2C1->CTLR1 &= ~I2C_CTLR1_ACK;
+			if(I2C_PEC(xfer)) I2C1->CTLR1 |= I2C_CTLR1_PEC;
+			if(!(xfer->flags & I2C_XFER_NOSTOP)) I2C1->CTLR1 |= I2C_CTLR1_STOP;
 		}
 
-		// Wait for the bus to finish transmitting
-		while(!i2c_status(I2C_EVENT_MASTER_BYTE_TRANSMITTED));
+		uint8_t byte = I2C1->DATAR;
+		if(i2c_idx < i2c_rkeep && !i2c_rx_byte(xfer, i2c_idx, byte))
+		{
+			// Streamed read ended early. The next byte is already coming,
+			// NACK it, drop it and STOP after it
+			i2c_rkeep = i2c_idx + 1;
+			if(i2c_idx + 2 < i2c_rend)
+			{
+				i2c_rend = i2c_idx + 2;
+				I2C1->CTLR1 &= ~I2C_CTLR1_ACK;
+				if(!(xfer->flags & I2C_XFER_NOSTOP)) I2C1->CTLR1 |= I2C_CTLR1_STOP;
+			}
+		}
+		if(++i2c_idx == i2c_rend) i2c_irq_finish(i2c_error());
 	}
+}
+
+void I2C1_ER_IRQHandler(void) __attribute__((interrupt));
+void I2C1_ER_IRQHandler(void)
+{
+	i2c_err_t err = i2c_error();
 
-	// Send a STOP Condition, to aut-reset for the next operation
+	// The event handler got to the flag first, eg a PEC mismatch on the
+	// last byte, and has already reported it
+	if(err == I2C_OK) return;
+
+	// Release the bus and fail the running transfer
 	I2C1->CTLR1 |= I2C_CTLR1_STOP;
+	if(i2c_cur != NULL) i2c_irq_finish(err);
+	else I2C1->CTLR2 &= ~I2C_CTLR2_ITERREN;
+}
+#endif
 
-	return i2c_ret;
+
+/// @brief Sets the mode of the SCL and SDA pins of a bus
+/// @param bus Bus Handle
+/// @param cfg GPIO_CNF_* | GPIO_Speed_* nibble for both pins
+/// @return None
+static void i2c_pins(const i2c_bus_t *bus, const uint32_t cfg)
+{
+	bus->port->CFGLR &= ~(0x0F << (4 * bus->pin_sda));
+	bus->port->CFGLR |= cfg << (4 * bus->pin_sda);
+	bus->port->CFGLR &= ~(0x0F << (4 * bus->pin_scl));
+	bus->port->CFGLR |= cfg << (4 * bus->pin_scl);
+}
+
+
+/// @brief Resets the I2C Peripheral and sets it up for the hardware bus
+/// @param None
+/// @return None
+static void i2c_setup(void)
+{
+	// Toggle the I2C Reset bit to init Registers
+	RCC->APB1PRSTR |=  RCC_APB1Periph_I2C1;
+	RCC->APB1PRSTR &= ~RCC_APB1Periph_I2C1;
+
+	// Enable the I2C Peripheral Clock
+	RCC->APB1PCENR |= RCC_APB1Periph_I2C1;
+
+	// Enable the Alternate Function enable bit, the ports are enabled by
+	// i2c_bus_init()
+	RCC->APB2PCENR |= RCC_APB2Periph_AFIO;
+
+	#ifdef I2C_USE_DMA
+	// Enable the DMA Controller for the payload channels
+	RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+	#endif
+
+	// Reset the AFIO_PCFR1 register, then set it up
+	AFIO->PCFR1 &= ~(0x04400002);
+	AFIO->PCFR1 |= i2c_hw->afio;
+
+	// Set the GPIO Settings for SCL and SDA, on the selected port
+	i2c_pins(i2c_hw, GPIO_Speed_10MHz | GPIO_CNF_OUT_OD_AF);
+
+	// Set the Prerate frequency
+	uint16_t i2c_conf = I2C1->CTLR2 & ~I2C_CTLR2_FREQ;
+	i2c_conf |= (FUNCONF_SYSTEM_CORE_CLOCK / I2C_PRERATE) & I2C_CTLR2_FREQ;
+	I2C1->CTLR2 = i2c_conf;
+
+	// Set I2C Clock
+	I2C1->CKCFGR = i2c_hw->ckcfgr;
+
+	// Enable the I2C Peripheral
+	I2C1->CTLR1 |= I2C_CTLR1_PE;
+}
+
+
+/// @brief Drives one of the I2C pins of the hardware bus as a plain
+/// open-drain GPIO
+/// @param pin pin_scl or pin_sda of the bus
+/// @param high 1 to release the line, 0 to pull it low
+/// @return None
+static void i2c_gpio_write(const uint8_t pin, const uint8_t high)
+{
+	i2c_hw->port->BSHR = high ? (1 << pin) : (1 << (16 + pin));
+	Delay_Us(I2C_RECOVER_HALF_US);
+}
+
+
+#ifdef I2C_USE_SOFT
+/*** Software Backend ********************************************************/
+// Pins and timing of a software transfer
+typedef struct {
+	GPIO_TypeDef *port;
+	uint32_t scl;        // SCL pin mask
+	uint32_t sda;        // SDA pin mask
+	uint32_t delay;      // Half bit delay, in loops
+	uint32_t deadline;   // SysTick value the transfer has to finish by
+} i2c_soft_io_t;
+
+/// @brief Spins for [loops] * I2C_SOFT_LOOP_CYCLES core cycles
+/// @param loops number of delay loops
+/// @return None
+__attribute__((always_inline))
+static inline void i2c_soft_delay(uint32_t loops)
+{
+	if(loops) __asm__ volatile("1: addi %0, %0, -1\n\tbnez %0, 1b" : "+r"(loops));
+}
+
+/// @brief Releases SCL and waits for it to rise. Slaves may hold it low to
+/// stretch the clock, up to the transfer deadline
+/// @param io Software bus pins
+/// @return i2c_err_t, I2C_ERR_TIMEOUT if SCL never rose
+__attribute__((always_inline))
+static inline i2c_err_t i2c_soft_scl_release(const i2c_soft_io_t *io)
+{
+	io->port->BSHR = io->scl;
+	while(!(io->port->INDR & io->scl))
+		if(i2c_expired(io->deadline)) return I2C_ERR_TIMEOUT;
+	return I2C_OK;
+}
+
+/// @brief Clocks out a byte MSB first, then reads the ACK bit. SCL is low
+/// on entry and on exit. Runs from RAM, so flash wait states do not slow
+/// the bus down
+/// @param io Software bus pins
+/// @param byte to write
+/// @return i2c_err_t, I2C_ERR_NACK if the byte was not ACKed
+static i2c_err_t i2c_soft_write_byte(const i2c_soft_io_t *io, uint8_t byte)
+	__attribute__((noinline, section(".srodata")));
+static i2c_err_t i2c_soft_write_byte(const i2c_soft_io_t *io, uint8_t byte)
+{
+	GPIO_TypeDef *port = io->port;
+
+	// 1s are shifted in behind the data, so the 9th bit releases SDA for
+	// the ACK
+	for(uint8_t bit = 0; bit < 9; bit++)
+	{
+		port->BSHR = (byte & 0x80) ? io->sda : (io->sda << 16);
+		byte = (byte << 1) | 0x01;
+		i2c_soft_delay(io->delay);
+
+		if(i2c_soft_scl_release(io) != I2C_OK) return I2C_ERR_TIMEOUT;
+		i2c_soft_delay(io->delay);
+
+		uint32_t in = port->INDR;
+		port->BSHR = io->scl << 16;
+		if(bit == 8 && (in & io->sda)) return I2C_ERR_NACK;
+	}
+
+	return I2C_OK;
+}
+
+/// @brief Clocks in a byte MSB first, then sends the ACK bit. SCL is low on
+/// entry and on exit. Runs from RAM
+/// @param io Software bus pins
+/// @param out where to store the byte
+/// @param ack 1 to ACK the byte and keep reading, 0 to NACK the last byte
+/// @return i2c_err_t, I2C_OK on success
+static i2c_err_t i2c_soft_read_byte(const i2c_soft_io_t *io, uint8_t *out,
+                                    const uint8_t ack)
+	__attribute__((noinline, section(".srodata")));
+static i2c_err_t i2c_soft_read_byte(const i2c_soft_io_t *io, uint8_t *out,
+                                    const uint8_t ack)
+{
+	GPIO_TypeDef *port = io->port;
+	uint8_t byte = 0;
+
+	// Let the Slave drive SDA
+	port->BSHR = io->sda;
+	for(uint8_t bit = 0; bit < 8; bit++)
+	{
+		i2c_soft_delay(io->delay);
+		if(i2c_soft_scl_release(io) != I2C_OK) return I2C_ERR_TIMEOUT;
+		i2c_soft_delay(io->delay);
+
+		byte = (byte << 1) | ((port->INDR & io->sda) ? 1 : 0);
+		port->BSHR = io->scl << 16;
+	}
+
+	// ACK Bit
+	port->BSHR = ack ? (io->sda << 16) : io->sda;
+	i2c_soft_delay(io->delay);
+	if(i2c_soft_scl_release(io) != I2C_OK) return I2C_ERR_TIMEOUT;
+	i2c_soft_delay(io->delay);
+	port->BSHR = io->scl << 16;
+
+	*out = byte;
+	return I2C_OK;
+}
+
+/// @brief Sends a START, or a repeated START if the bus was kept. SCL is
+/// low on exit
+/// @param io Software bus pins
+/// @return i2c_err_t, I2C_ERR_BUSY if something else holds the bus
+static i2c_err_t i2c_soft_start(const i2c_soft_io_t *io)
+{
+	io->port->BSHR = io->sda;
+	i2c_soft_delay(io->delay);
+	if(i2c_soft_scl_release(io) != I2C_OK) return I2C_ERR_BUSY;
+	i2c_soft_delay(io->delay);
+	if(!(io->port->INDR & io->sda)) return I2C_ERR_BUSY;
+
+	// SDA falls while SCL is high
+	io->port->BSHR = io->sda << 16;
+	i2c_soft_delay(io->delay);
+	io->port->BSHR = io->scl << 16;
+	return I2C_OK;
+}
+
+/// @brief Sends a STOP, SCL must be low
+/// @param io Software bus pins
+/// @return None
+static void i2c_soft_stop(const i2c_soft_io_t *io)
+{
+	// SDA rises while SCL is high
+	io->port->BSHR = io->sda << 16;
+	i2c_soft_delay(io->delay);
+	i2c_soft_scl_release(io);
+	i2c_soft_delay(io->delay);
+	io->port->BSHR = io->sda;
+	i2c_soft_delay(io->delay);
+}
+
+/// @brief Fills in the pins and timing of a software bus
+/// @param bus Software Bus Handle
+/// @param budget SysTick ticks the transfer may take
+/// @return i2c_soft_io_t
+static i2c_soft_io_t i2c_soft_io(const i2c_bus_t *bus, const uint32_t budget)
+{
+	i2c_soft_io_t io = {
+		.port     = bus->port,
+		.scl      = 1 << bus->pin_scl,
+		.sda      = 1 << bus->pin_sda,
+		.delay    = bus->soft_delay,
+		.deadline = SysTick->CNT + budget,
+	};
+
+	// Take the pins as open-drain GPIOs, a hardware bus may have had them
+	i2c_pins(bus, GPIO_Speed_30MHz | GPIO_CNF_OUT_OD);
+	return io;
+}
+
+/// @brief Runs a whole transfer on a software bus, same rules as the
+/// hardware transfer
+/// @param bus Software Bus Handle
+/// @param xfer Transfer Descriptor
+/// @return i2c_err_t, I2C_OK on success
+static i2c_err_t i2c_soft_xfer(const i2c_bus_t *bus, i2c_xfer_t *xfer)
+{
+	i2c_err_t i2c_ret = I2C_OK;
+	const i2c_soft_io_t io = i2c_soft_io(bus, i2c_budget(xfer));
+
+	#ifdef I2C_USE_PEC
+	// There is no hardware to do it, the PEC is worked out as it goes
+	uint8_t crc = 0, byte;
+	#define I2C_SOFT_CRC(b) do { if(I2C_PEC(xfer)) {byte = (b); crc = i2c_crc8(crc, &byte, 1);} } while(0)
+	#else
+	#define I2C_SOFT_CRC(b)
+	#endif
+
+	// Write phase, Address + Register prefix + payload
+	const uint32_t wtotal = i2c_wtotal(xfer);
+	if(wtotal || !xfer->rlen)
+	{
+		i2c_ret = i2c_soft_start(&io);
+		if(i2c_ret == I2C_OK) i2c_ret = i2c_soft_write_byte(&io, xfer->addr << 1);
+		I2C_SOFT_CRC(xfer->addr << 1);
+		for(uint8_t seg = 0; i2c_ret == I2C_OK && seg <= xfer->wvec_len + 1; seg++)
+		{
+			const uint8_t *buf;
+			uint16_t len = i2c_wseg(xfer, seg, &buf);
+			for(uint16_t i = 0; i2c_ret == I2C_OK && i < len; i++)
+			{
+				i2c_ret = i2c_soft_write_byte(&io, buf[i]);
+				I2C_SOFT_CRC(buf[i]);
+			}
+		}
+
+		#ifdef I2C_USE_PEC
+		// The PEC follows the last byte, unless a read carries it instead
+		if(i2c_ret == I2C_OK && I2C_PEC(xfer) && wtotal && !xfer->rlen)
+			i2c_ret = i2c_soft_write_byte(&io, crc);
+		#endif
+	}
+
+	// Read phase, after a repeated START. The last byte is NACKed
+	if(i2c_ret == I2C_OK && xfer->rlen)
+	{
+		const uint16_t rtotal = xfer->rlen + I2C_PEC(xfer);
+		i2c_ret = i2c_soft_start(&io);
+		if(i2c_ret == I2C_OK) i2c_ret = i2c_soft_write_byte(&io, (xfer->addr << 1) | 0x01);
+		I2C_SOFT_CRC((xfer->addr << 1) | 0x01);
+		uint8_t stop = 0;
+		for(uint16_t i = 0; i2c_ret == I2C_OK && i < xfer->rlen; i++)
+		{
+			// After a streamed read is ended early, one more byte is NACKed
+			// and dropped
+			uint8_t byte;
+			i2c_ret = i2c_soft_read_byte(&io, &byte, i < rtotal - 1 && !stop);
+			if(stop || i2c_ret != I2C_OK) break;
+			I2C_SOFT_CRC(byte);
+			if(!i2c_rx_byte(xfer, i, byte)) stop = 1;
+		}
+
+		#ifdef I2C_USE_PEC
+		uint8_t pec;
+		if(i2c_ret == I2C_OK && I2C_PEC(xfer) && !stop)
+		{
+			i2c_ret = i2c_soft_read_byte(&io, &pec, 0);
+			if(i2c_ret == I2C_OK && pec != crc) i2c_ret = I2C_ERR_PEC;
+		}
+		#endif
+	}
+	#undef I2C_SOFT_CRC
+
+	if(i2c_ret != I2C_OK || !(xfer->flags & I2C_XFER_NOSTOP)) i2c_soft_stop(&io);
+	return i2c_ret;
+}
+
+/// @brief Runs a transfer on a software bus, and counts it
+/// @param bus Software Bus Handle
+/// @param xfer Transfer Descriptor
+/// @return i2c_err_t, I2C_OK on success
+static i2c_err_t i2c_soft_run(const i2c_bus_t *bus, i2c_xfer_t *xfer)
+{
+	xfer->busy = 1;
+	uint32_t start = SysTick->CNT;
+	i2c_err_t i2c_ret = i2c_soft_xfer(bus, xfer);
+	I2C_STATS_RECORD(xfer, i2c_ret, SysTick->CNT - start);
+	(void)start;
+
+	return i2c_ret;
+}
+
+/// @brief Bus recovery for a software bus, see i2c_recover
+/// @param bus Software Bus Handle
+/// @return i2c_err_t, I2C_OK if both lines are high afterwards
+static i2c_err_t i2c_soft_recover(const i2c_bus_t *bus)
+{
+	i2c_soft_io_t io = i2c_soft_io(bus, Ticks_from_Us(I2C_TIMEOUT_US));
+
+	// Clock SCL until the Slave lets go of SDA, then STOP
+	for(uint8_t clk = 0; clk < 9 && !(io.port->INDR & io.sda); clk++)
+	{
+		io.port->BSHR = io.scl << 16;
+		Delay_Us(I2C_RECOVER_HALF_US);
+		i2c_soft_scl_release(&io);
+		Delay_Us(I2C_RECOVER_HALF_US);
+	}
+	io.port->BSHR = io.scl << 16;
+	i2c_soft_stop(&io);
+
+	if((io.port->INDR & (io.scl | io.sda)) != (io.scl | io.sda)) return I2C_ERR_BUSY;
+	return I2C_OK;
+}
+#endif
+
+
+/*** API Functions ***********************************************************/
+void i2c_bus_init(i2c_bus_t *bus)
+{
+	// Enable the GPIO Port of the bus
+	RCC->APB2PCENR |= bus->port_rcc;
+
+	#ifdef I2C_USE_SOFT
+	if(bus->soft)
+	{
+		// Half a bit-time in delay loops, less the cost of moving the pins
+		int32_t loops = (int32_t)(FUNCONF_SYSTEM_CORE_CLOCK / (2 * bus->clk_rate));
+		loops = (loops - I2C_SOFT_OVERHEAD) / I2C_SOFT_LOOP_CYCLES;
+		bus->soft_delay = (loops > 0) ? loops : 0;
+		bus->clk_real = FUNCONF_SYSTEM_CORE_CLOCK /
+		         (2 * (bus->soft_delay * I2C_SOFT_LOOP_CYCLES + I2C_SOFT_OVERHEAD));
+
+		// Release both lines, then make them open-drain outputs
+		bus->port->BSHR = (1 << bus->pin_scl) | (1 << bus->pin_sda);
+		i2c_pins(bus, GPIO_Speed_30MHz | GPIO_CNF_OUT_OD);
+	} else
+	#endif
+	{
+		bus->clk_real = i2c_clk_plan(bus->clk_rate, &bus->ckcfgr);
+	}
+
+	// 9 bit-times per byte, rounded up to whole SysTick ticks
+	bus->byte_ticks = (9 * Ticks_from_Us(1000000) + bus->clk_real - 1) / bus->clk_real;
+}
+
+
+uint32_t i2c_clk_plan(const uint32_t clk_rate, uint16_t *ckcfgr)
+{
+	if(ckcfgr != NULL) *ckcfgr = I2C_CKCFGR_PLAN(clk_rate);
+	return I2C_CLK_REAL(clk_rate);
+}
+
+
+void i2c_bus_select(i2c_bus_t *bus)
+{
+	#ifdef I2C_USE_SOFT
+	// Software busses leave I2C1 alone
+	if(bus->soft) {i2c_bus = bus; return;}
+
+	// A software bus may have borrowed the hardware pins, hand them back
+	if(i2c_bus->soft) i2c_pins(i2c_hw, GPIO_Speed_10MHz | GPIO_CNF_OUT_OD_AF);
+	#endif
+
+	i2c_bus = bus;
+	if(bus == i2c_hw) return;
+
+	// A STOP from the last transfer must be out before the pins change
+	uint32_t deadline = SysTick->CNT + Ticks_from_Us(I2C_TIMEOUT_US);
+	while((I2C1->CTLR1 & I2C_CTLR1_STOP) && !i2c_expired(deadline));
+
+	// CKCFGR can only be written while the Peripheral is disabled. Disabling
+	// it keeps the register setup, no RCC reset is needed
+	I2C1->CTLR1 &= ~I2C_CTLR1_PE;
+
+	// Let go of the old pins, the pull-ups keep that bus idle
+	if(bus->afio != i2c_hw->afio) i2c_pins(i2c_hw, GPIO_CNF_IN_FLOATING);
+
+	AFIO->PCFR1 = (AFIO->PCFR1 & ~(0x04400002)) | bus->afio;
+	i2c_pins(bus, GPIO_Speed_10MHz | GPIO_CNF_OUT_OD_AF);
+	I2C1->CKCFGR = bus->ckcfgr;
+
+	I2C1->CTLR1 |= I2C_CTLR1_PE;
+	i2c_hw = bus;
+}
+
+
+i2c_bus_t *i2c_bus_current(void)
+{
+	return i2c_bus;
+}
+
+
+i2c_err_t i2c_init(uint32_t clk_rate)
+{
+	i2c_bus_pinout.clk_rate = clk_rate;
+	return i2c_init_bus(&i2c_bus_pinout);
+}
+
+
+i2c_err_t i2c_init_bus(i2c_bus_t *bus)
+{
+	i2c_bus_init(bus);
+	i2c_bus = i2c_hw = bus;
+	i2c_setup();
+
+	#ifdef I2C_USE_IRQ
+	// Start with an empty queue, the Interrupts are enabled per transfer
+	i2c_q_head = i2c_q_tail = 0;
+	i2c_cur = NULL;
+	NVIC_EnableIRQ(I2C1_EV_IRQn);
+	NVIC_EnableIRQ(I2C1_ER_IRQn);
+	#endif
+
+	//TODO:
+	// Check error states
+	if(I2C1->STAR1 & I2C_STAR1_BERR) 
+	{
+		I2C1->STAR1 &= ~(I2C_STAR1_BERR); 
+		return I2C_ERR_BERR;
+	}
+
+	return I2C_OK;
+}
+
+
+void i2c_scan(void (*callback)(const uint8_t))
+{
+	static const i2c_range_t all = {I2C_ADDR_FIRST, I2C_ADDR_LAST};
+	i2c_scan_ranges(&all, 1, callback);
+}
+
+
+uint8_t i2c_scan_ranges(const i2c_range_t *ranges, const uint8_t count,
+                        void (*callback)(const uint8_t))
+{
+	uint8_t found = 0;
+	uint32_t start = SysTick->CNT;
+
+	// Short per-ping deadline, 4 byte-times plus slack. A missing device
+	// costs one NACKed address byte, not the full transfer timeout
+	i2c_xfer_t xfer = {.timeout_us = I2C_SCAN_SLACK_US + (4 * 9 * 1000000) / i2c_bus->clk_real};
+
+	I2C_STATS_PAUSE(1);
+	for(uint8_t r = 0; r < count; r++)
+	{
+		// Keep out of the reserved addresses
+		uint8_t first = ranges[r].first < I2C_ADDR_FIRST ? I2C_ADDR_FIRST : ranges[r].first;
+		uint8_t last  = ranges[r].last  > I2C_ADDR_LAST  ? I2C_ADDR_LAST  : ranges[r].last;
+
+		for(uint8_t addr = first; addr <= last; addr++)
+		{
+			uint32_t bit = 1UL << (addr & 0x1F);
+
+			// Ping the address, record it and call the callback if it responds
+			xfer.addr = addr;
+			if(i2c_xfer(&xfer) == I2C_OK)
+			{
+				i2c_present[addr >> 5] |= bit;
+				found++;
+				if(callback != NULL) callback(addr);
+			} else {
+				i2c_present[addr >> 5] &= ~bit;
+			}
+		}
+	}
+
+	I2C_STATS_PAUSE(0);
+	i2c_scan_ticks = SysTick->CNT - start;
+	return found;
+}
+
+
+uint8_t i2c_is_present(const uint8_t addr)
+{
+	return (i2c_present[(addr >> 5) & 0x03] >> (addr & 0x1F)) & 0x01;
+}
+
+
+uint32_t i2c_scan_time_us(void)
+{
+	return i2c_scan_ticks / DELAY_US_TIME;
+}
+
+/// @brief Frees a stuck bus, see i2c_recover. The caller owns the bus
+/// @param None
+/// @return i2c_err_t, I2C_OK if both lines were released
+static i2c_err_t i2c_recover_bus(void)
+{
+	#ifdef I2C_USE_SOFT
+	if(i2c_bus->soft) return i2c_soft_recover(i2c_bus);
+	#endif
+
+	#ifdef I2C_USE_IRQ
+	// Keep the engine out of the way, and fail whatever it was running
+	NVIC_DisableIRQ(I2C1_EV_IRQn);
+	NVIC_DisableIRQ(I2C1_ER_IRQn);
+	if(i2c_cur != NULL) i2c_irq_finish_only(I2C_ERR_BUSY);
+	#endif
+
+	// Take the pins from the peripheral, as open-drain outputs released high
+	GPIO_TypeDef *port = i2c_hw->port;
+	const uint8_t scl = i2c_hw->pin_scl, sda = i2c_hw->pin_sda;
+	I2C1->CTLR1 &= ~I2C_CTLR1_PE;
+	port->BSHR = (1 << scl) | (1 << sda);
+	i2c_pins(i2c_hw, GPIO_Speed_10MHz | GPIO_CNF_OUT_OD);
+	Delay_Us(I2C_RECOVER_HALF_US);
+
+	// Clock SCL up to 9 times, until the Slave finishes its byte and lets
+	// go of SDA. Slaves stretching the clock are given the usual deadline
+	for(uint8_t clk = 0; clk < 9 && !(port->INDR & (1 << sda)); clk++)
+	{
+		i2c_gpio_write(scl, 0);
+		port->BSHR = (1 << scl);
+
+		uint32_t deadline = SysTick->CNT + Ticks_from_Us(I2C_TIMEOUT_US);
+		while(!(port->INDR & (1 << scl)) && !i2c_expired(deadline));
+		Delay_Us(I2C_RECOVER_HALF_US);
+	}
+
+	// Manual STOP: SDA rises while SCL is high
+	i2c_gpio_write(scl, 0);
+	i2c_gpio_write(sda, 0);
+	i2c_gpio_write(scl, 1);
+	i2c_gpio_write(sda, 1);
+
+	uint32_t lines = port->INDR & ((1 << scl) | (1 << sda));
+
+	// Reset the Peripheral through RCC, and hand the pins back to it
+	i2c_setup();
+
+	#ifdef I2C_USE_IRQ
+	// Carry on with anything still queued
+	if(i2c_cur == NULL) i2c_irq_next();
+	NVIC_EnableIRQ(I2C1_EV_IRQn);
+	NVIC_EnableIRQ(I2C1_ER_IRQn);
+	#endif
+
+	// Both lines must have been released for the bus to be usable
+	if(lines != ((1 << scl) | (1 << sda))) return I2C_ERR_BUSY;
+	return I2C_OK;
+}
+
+
+#ifdef I2C_USE_RETRY
+/// @brief Checks whether a failed transfer is worth another attempt, and
+/// whether the bus needs recovering first
+/// @param err result of the failed attempt
+/// @return 0 = give up, 1 = retry, 2 = recover the bus then retry
+static uint8_t i2c_retry_action(const i2c_err_t err)
+{
+	switch(err)
+	{
+		case I2C_ERR_NACK:
+		case I2C_ERR_ARLO:
+		case I2C_ERR_PEC:
+			return 1;
+		case I2C_ERR_BERR:
+		case I2C_ERR_BUSY:
+		case I2C_ERR_TIMEOUT:
+			return 2;
+		default:
+			return 0;
+	}
+}
+#endif
+
+
+#ifndef I2C_USE_IRQ
+/// @brief Runs one attempt of a transfer, see i2c_xfer
+/// @param xfer Transfer Descriptor
+/// @return i2c_err_t. I2C_OK On Success
+static i2c_err_t i2c_xfer_once(i2c_xfer_t *xfer)
+{
+	i2c_err_t i2c_ret = I2C_OK;
+	xfer->busy = 1;
+	if(xfer->bus != NULL) i2c_bus_select(xfer->bus);
+
+	#ifdef I2C_USE_SOFT
+	if(i2c_bus->soft) return i2c_soft_run(i2c_bus, xfer);
+	#endif
+
+	I2C_SPEED_APPLY(xfer->addr);
+
+	uint32_t start = SysTick->CNT;
+	i2c_deadline = start + i2c_budget(xfer);
+
+	// Wait for the bus to become not busy - set state to I2C_ERR_BUSY on failure.
+	// If the last transfer kept the bus (I2C_XFER_NOSTOP), carry on with it
+	if(!(I2C1->STAR2 & I2C_STAR2_MSL))
+	{
+		while(I2C1->STAR2 & I2C_STAR2_BUSY) 
+			if(i2c_expired(i2c_deadline)) {i2c_ret = I2C_ERR_BUSY; break;}
+	}
+	I2C_PEC_BEGIN(xfer);
+
+	// Write phase, Register prefix then payload. Only skipped by reads with
+	// nothing to write first
+	const uint32_t wtotal = i2c_wtotal(xfer);
+	if(i2c_ret == I2C_OK && (wtotal || !xfer->rlen))
+	{
+		i2c_ret = i2c_start((xfer->addr << 1) & 0xFE);
+
+		// Every segment is streamed straight from its own buffer
+		for(uint8_t seg = 0; i2c_ret == I2C_OK && seg <= xfer->wvec_len + 1; seg++)
+		{
+			const uint8_t *buf;
+			uint16_t len = i2c_wseg(xfer, seg, &buf);
+			i2c_ret = i2c_write_payload(buf, len);
+		}
+
+		// The PEC follows the last byte, unless a read carries it instead
+		if(i2c_ret == I2C_OK && I2C_PEC(xfer) && wtotal && !xfer->rlen)
+			I2C1->CTLR1 |= I2C_CTLR1_PEC;
+
+		// Wait for the bus to finish transmitting
+		if(i2c_ret == I2C_OK && wtotal)
+			i2c_ret = i2c_wait_event(I2C_EVENT_MASTER_BYTE_TRANSMITTED);
+	}
+
+	// Read phase, after a repeated START
+	if(i2c_ret == I2C_OK && xfer->rlen)
+	{
+		// ACK every byte but the last, a single byte is NACKed straight away
+		if(xfer->rlen + I2C_PEC(xfer) > 1) I2C1->CTLR1 |= I2C_CTLR1_ACK;
+		else                               I2C1->CTLR1 &= ~I2C_CTLR1_ACK;
+
+		#ifdef I2C_USE_DMA
+		// Long reads are moved by DMA, arm it before ADDR is cleared
+		if(xfer->rlen >= I2C_DMA_THRESHOLD && xfer->rlen > 1 && !I2C_PEC(xfer) &&
+		   !xfer->rchunk)
+			i2c_dma_rx_arm(xfer->rbuf, xfer->rlen);
+		#endif
+
+		i2c_ret = i2c_start((xfer->addr << 1) | 0x01);
+		if(i2c_ret == I2C_OK) i2c_ret = i2c_read_payload(xfer);
+
+		#ifdef I2C_USE_DMA
+		i2c_dma_stop();
+		#endif
+	}
+
+	// Send the STOP Condition to auto-reset for the next operation, unless
+	// the caller wants to keep the bus
+	if(i2c_ret != I2C_OK || !(xfer->flags & I2C_XFER_NOSTOP))
+		I2C1->CTLR1 |= I2C_CTLR1_STOP;
+
+	I2C_STATS_RECORD(xfer, i2c_ret, SysTick->CNT - start);
+	return i2c_ret;
+}
+#else
+/// @brief Runs one attempt of a transfer, see i2c_xfer
+/// @param xfer Transfer Descriptor
+/// @return i2c_err_t. I2C_OK On Success
+static i2c_err_t i2c_xfer_once(i2c_xfer_t *xfer)
+{
+	i2c_err_t i2c_ret = i2c_submit(xfer);
+	if(i2c_ret != I2C_OK) return i2c_ret;
+	return i2c_wait(xfer);
+}
+#endif
+
+
+#ifdef I2C_USE_COALESCE
+#ifdef I2C_USE_IRQ
+/// @brief Keeps the error of a queued merged write. Called by the engine
+/// @param xfer the merged write
+/// @return None
+static void i2c_wc_done(i2c_xfer_t *xfer)
+{
+	if(i2c_wc_err == I2C_OK) i2c_wc_err = xfer->err;
+}
+
+/// @brief Queues the pending merged write, ahead of anything queued after
+/// it. Never waits, so Interrupt handlers can drain it too. Its result is
+/// kept by i2c_wc_done()
+/// @param None
+/// @return i2c_err_t. I2C_OK if queued, or when nothing is pending.
+/// I2C_ERR_BUSY if the queue is full, the write stays pending
+static i2c_err_t i2c_wc_drain(void)
+{
+	uint8_t irq = i2c_irq_mask();
+	uint8_t len = i2c_wc_len;
+	if(len == 0) {i2c_irq_restore(irq); return I2C_OK;}
+
+	// Emptied first, a failed write is dropped rather than sent again. It
+	// also keeps i2c_submit() from draining it a second time
+	i2c_wc_xfer = (i2c_xfer_t){.addr = i2c_wc_addr, .reg_len = 1, .reg = {i2c_wc_reg},
+	                           .wbuf = i2c_wc_buf, .wlen = len,
+	                           .bus = (i2c_bus_t *)i2c_wc_bus, .callback = i2c_wc_done};
+	i2c_wc_len = 0;
+
+	#ifdef I2C_USE_SOFT
+	// Software busses run it straight away, not with Interrupts masked
+	if(i2c_wc_bus->soft) {i2c_irq_restore(irq); irq = 0;}
+	#endif
+
+	i2c_err_t i2c_ret = i2c_submit(&i2c_wc_xfer);
+	if(i2c_ret != I2C_OK) i2c_wc_len = len;
+	else                  i2c_wc_xfers++;
+	i2c_irq_restore(irq);
+	return i2c_ret;
+}
+
+// Waits for the merged write on its way out, so i2c_wc_buf can be reused
+#define I2C_WC_IDLE() do { \
+	if(i2c_wc_xfer.busy) i2c_wait(&i2c_wc_xfer); \
+} while(0)
+#else
+/// @brief Sends the pending merged write. The caller owns the bus
+/// @param None
+/// @return i2c_err_t. I2C_OK On Success, or when nothing is pending
+static i2c_err_t i2c_wc_drain(void)
+{
+	if(i2c_wc_len == 0) return I2C_OK;
+
+	// Emptied first, a failed write is dropped rather than sent again
+	i2c_xfer_t xfer = {.addr = i2c_wc_addr, .reg_len = 1, .reg = {i2c_wc_reg},
+	                   .wbuf = i2c_wc_buf, .wlen = i2c_wc_len,
+	                   .bus = (i2c_bus_t *)i2c_wc_bus};
+	i2c_wc_len = 0;
+	i2c_wc_xfers++;
+	i2c_err_t i2c_ret = i2c_xfer_once(&xfer);
+	if(i2c_wc_err == I2C_OK) i2c_wc_err = i2c_ret;
+	return i2c_ret;
+}
+
+#define I2C_WC_IDLE()
+#endif
+
+/// @brief Drains the merged write ahead of a transfer to the same device,
+/// the same address on the same bus
+/// @param xfer Transfer Descriptor about to run
+/// @return i2c_err_t. I2C_ERR_BUSY if the merged write could not be queued
+/// in IRQ Mode, [xfer] must then not go ahead of it. I2C_OK otherwise, the
+/// merged write's own errors are kept for i2c_coalesce_flush()
+static i2c_err_t i2c_wc_before(const i2c_xfer_t *xfer)
+{
+	const i2c_bus_t *bus = (xfer->bus != NULL) ? xfer->bus : i2c_bus;
+	if(i2c_wc_len == 0 || xfer->addr != i2c_wc_addr || bus != i2c_wc_bus)
+		return I2C_OK;
+
+	i2c_err_t i2c_ret = i2c_wc_drain();
+	return (i2c_ret == I2C_ERR_BUSY) ? I2C_ERR_BUSY : I2C_OK;
+}
+
+/// @brief Gets the kept merged write error, and clears it
+/// @param None
+/// @return i2c_err_t. I2C_OK if every merged write since the last call went out
+static i2c_err_t i2c_wc_take(void)
+{
+	i2c_err_t i2c_ret = i2c_wc_err;
+	i2c_wc_err = I2C_OK;
+	return i2c_ret;
+}
+
+// Anything else sent to the device has to see the merged write first
+#define I2C_WC_BEFORE(xfer) i2c_wc_before(xfer)
+
+#if I2C_COALESCE_US > 0
+#define I2C_WC_DUE() i2c_expired(i2c_wc_deadline)
+#else
+#define I2C_WC_DUE() 0
+#endif
+#else
+#define I2C_WC_BEFORE(xfer) I2C_OK
+#endif
+
+
+/// @brief Runs a transfer with its retries, and reports it, without
+/// draining the merged write first. The caller owns the bus
+/// @param xfer Transfer Descriptor
+/// @return i2c_err_t. I2C_OK On Success
+static i2c_err_t i2c_xfer_try(i2c_xfer_t *xfer)
+{
+	i2c_err_t i2c_ret = i2c_xfer_once(xfer);
+
+	#ifdef I2C_USE_RETRY
+	// Back off for twice as long after every failed attempt
+	uint32_t backoff = I2C_RETRY_BACKOFF_US;
+	for(uint8_t attempt = 0; i2c_ret != I2C_OK && attempt < xfer->retries; attempt++)
+	{
+		uint8_t action = i2c_retry_action(i2c_ret);
+		if(action == 0) break;
+		if(action == 2) i2c_recover_bus();
+		I2C_STATS_RETRY(xfer);
+
+		Delay_Us(backoff);
+		backoff <<= 1;
+
+		i2c_ret = i2c_xfer_once(xfer);
+	}
+	#endif
+
+	#ifndef I2C_USE_IRQ
+	// The IRQ engine reports its own transfers
+	xfer->err  = i2c_ret;
+	xfer->busy = 0;
+	if(xfer->callback != NULL) xfer->callback(xfer);
+	#endif
+
+	return i2c_ret;
+}
+
+/// @brief Runs a transfer with its retries, and reports it. The caller owns
+/// the bus
+/// @param xfer Transfer Descriptor
+/// @return i2c_err_t. I2C_OK On Success
+static i2c_err_t i2c_xfer_run(i2c_xfer_t *xfer)
+{
+	// A full queue only means the engine is busy, wait it out
+	while(I2C_WC_BEFORE(xfer) == I2C_ERR_BUSY);
+	return i2c_xfer_try(xfer);
+}
+
+
+#ifndef I2C_USE_IRQ
+/// @brief Takes the bus for the calling context. Never waits, a context
+/// can only find the bus taken when it has interrupted the owner
+/// @param None
+/// @return uint8_t, 1 if the bus was taken, 0 if it is already owned
+static uint8_t i2c_lock(void)
+{
+	uint8_t irq = i2c_irq_mask();
+	uint8_t taken = !i2c_locked;
+	i2c_locked = 1;
+	i2c_irq_restore(irq);
+	return taken;
+}
+
+/// @brief Runs the transfers deferred while the bus was owned, then
+/// releases it. The ring is checked for the last time with Interrupts
+/// masked, so nothing deferred can be left behind
+/// @param None
+/// @return None
+static void i2c_unlock(void)
+{
+	while(1)
+	{
+		uint8_t irq = i2c_irq_mask();
+		if(i2c_d_head == i2c_d_tail)
+		{
+			i2c_locked = 0;
+			i2c_irq_restore(irq);
+			return;
+		}
+		i2c_xfer_t *xfer = i2c_deferred[i2c_d_head];
+		i2c_d_head = (i2c_d_head + 1) & (I2C_DEFER_LEN - 1);
+		i2c_irq_restore(irq);
+
+		i2c_xfer_run(xfer);
+	}
+}
+
+
+i2c_err_t i2c_xfer(i2c_xfer_t *xfer)
+{
+	// Interrupted a transfer, running this one now would corrupt both
+	if(!i2c_lock())
+	{
+		xfer->err = I2C_ERR_BUSY;
+		return I2C_ERR_BUSY;
+	}
+
+	i2c_err_t i2c_ret = i2c_xfer_run(xfer);
+	i2c_unlock();
+	return i2c_ret;
+}
+
+
+i2c_err_t i2c_recover(void)
+{
+	if(!i2c_lock()) return I2C_ERR_BUSY;
+
+	i2c_err_t i2c_ret = i2c_recover_bus();
+	i2c_unlock();
+	return i2c_ret;
+}
+
+
+i2c_err_t i2c_defer(i2c_xfer_t *xfer)
+{
+	uint8_t irq = i2c_irq_mask();
+	uint8_t next = (i2c_d_tail + 1) & (I2C_DEFER_LEN - 1);
+	if(next == i2c_d_head) {i2c_irq_restore(irq); return I2C_ERR_BUSY;}
+
+	xfer->busy = 1;
+	xfer->err  = I2C_OK;
+	i2c_deferred[i2c_d_tail] = xfer;
+	i2c_d_tail = next;
+	i2c_irq_restore(irq);
+
+	// Nobody owns the bus, run it now rather than leave it waiting
+	if(i2c_lock()) i2c_unlock();
+	return I2C_OK;
+}
+#else
+// The Interrupt engine serialises every transfer through its queue
+i2c_err_t i2c_xfer(i2c_xfer_t *xfer)
+{
+	return i2c_xfer_run(xfer);
+}
+
+
+i2c_err_t i2c_recover(void)
+{
+	return i2c_recover_bus();
+}
+
+
+i2c_err_t i2c_defer(i2c_xfer_t *xfer)
+{
+	return i2c_submit(xfer);
+}
+#endif
+
+
+#ifdef I2C_USE_IRQ
+/// @brief Queues [count] transfers in one go, so the engine can not start
+/// on them, and nothing else can be queued, until all are in
+/// @param xfers array of Transfer Descriptors
+/// @param count number of transfers
+/// @return i2c_err_t. I2C_OK if queued, I2C_ERR_BUSY if they do not all fit
+static i2c_err_t i2c_submit_n(i2c_xfer_t *xfers, const uint8_t count)
+{
+	// Keep the engine, and any other context submitting, away from the
+	// queue while it is being pushed
+	uint8_t irq = i2c_irq_mask();
+
+	uint8_t free = (i2c_q_head - i2c_q_tail - 1) & (I2C_QUEUE_LEN - 1);
+	if(count > free) {i2c_irq_restore(irq); return I2C_ERR_BUSY;}
+
+	for(uint8_t k = 0; k < count; k++)
+	{
+		xfers[k].busy = 1;
+		xfers[k].err  = I2C_OK;
+		i2c_queue[i2c_q_tail] = &xfers[k];
+		i2c_q_tail = (i2c_q_tail + 1) & (I2C_QUEUE_LEN - 1);
+	}
+	if(i2c_cur == NULL) i2c_irq_next();
+	i2c_irq_restore(irq);
+
+	return I2C_OK;
+}
+
+
+i2c_err_t i2c_submit(i2c_xfer_t *xfer)
+{
+	// The merged write goes first, or neither does
+	if(I2C_WC_BEFORE(xfer) != I2C_OK) return I2C_ERR_BUSY;
+
+	#ifdef I2C_USE_SOFT
+	// Software busses are not queued, the transfer runs straight away
+	const i2c_bus_t *bus = (xfer->bus != NULL) ? xfer->bus : i2c_bus;
+	if(bus->soft)
+	{
+		xfer->err  = i2c_soft_run(bus, xfer);
+		xfer->busy = 0;
+		if(xfer->callback != NULL) xfer->callback(xfer);
+		return I2C_OK;
+	}
+	#endif
+
+	return i2c_submit_n(xfer, 1);
+}
+
+
+i2c_err_t i2c_wait(i2c_xfer_t *xfer)
+{
+	#ifdef I2C_USE_WFI
+	const i2c_bus_t *bus = (xfer->bus != NULL) ? xfer->bus : i2c_bus;
+	#endif
+
+	while(xfer->busy)
+	{
+		// Only the running transfer can be stuck, and only once its own
+		// budget, counted from its own START, has run out. Transfers queued
+		// ahead of this one are left to finish, however long they take
+		NVIC_DisableIRQ(I2C1_EV_IRQn);
+		NVIC_DisableIRQ(I2C1_ER_IRQn);
+		uint8_t  running  = (i2c_cur != NULL);
+		uint32_t deadline = i2c_cur_deadline;
+		if(running && i2c_expired(deadline))
+		{
+			I2C1->CTLR1 |= I2C_CTLR1_STOP;
+			i2c_irq_finish(I2C_ERR_TIMEOUT);
+			running = 0;
+		}
+		NVIC_EnableIRQ(I2C1_EV_IRQn);
+		NVIC_EnableIRQ(I2C1_ER_IRQn);
+
+		#ifdef I2C_USE_WFI
+		// Every byte of the engine is an Interrupt, which wakes it up
+		if(running && bus->sleep)
+		{
+			uint8_t irq = i2c_irq_mask();
+			if(xfer->busy) i2c_sleep(deadline);
+			i2c_irq_restore(irq);
+		}
+		#endif
+	}
+	return xfer->err;
+}
+#endif
+
+
+/// @brief Runs the links of a chain once each, in order. A link retried on
+/// its own would run as a new transaction after the STOP, outside the
+/// chain, so their retries are held off here. So would a merged write
+/// drained by a link, the caller drains them all before the chain starts.
+/// The caller owns the bus
+/// @param xfers, array of Transfer Descriptors
+/// @param count, number of links
+/// @return i2c_err_t. The result of the first failing link, I2C_OK if none
+static i2c_err_t i2c_chain_once(i2c_xfer_t *xfers, const uint8_t count)
+{
+	// The engine sends a STOP on any error, which ends the chain on the bus
+	i2c_err_t i2c_ret = I2C_OK;
+	for(uint8_t k = 0; k < count; k++)
+	{
+		if(i2c_ret != I2C_OK) {xfers[k].err = i2c_ret; continue;}
+
+		uint8_t retries = xfers[k].retries;
+		xfers[k].retries = 0;
+		i2c_ret = i2c_xfer_try(&xfers[k]);
+		xfers[k].retries = retries;
+	}
+	return i2c_ret;
+}
+
+
+i2c_err_t i2c_chain(i2c_xfer_t *xfers, const uint8_t count)
+{
+	if(count == 0) return I2C_OK;
+
+	// Every link but the last ends in a repeated START
+	for(uint8_t k = 0; k < count; k++)
+	{
+		if(k + 1 < count) xfers[k].flags |= I2C_XFER_NOSTOP;
+		else              xfers[k].flags &= ~I2C_XFER_NOSTOP;
+	}
+
+	#ifdef I2C_USE_IRQ
+	// Queue the whole chain at once, so no other transfer can get in
+	// between the links. It is never queued a link at a time, another
+	// context could queue a transfer in the middle of it. Software busses
+	// run it link by link below
+	const i2c_bus_t *bus = (xfers[0].bus != NULL) ? xfers[0].bus : i2c_bus;
+	#ifdef I2C_USE_SOFT
+	if(!bus->soft)
+	#endif
+	{
+		(void)bus;
+		// The queue keeps a slot free, a longer chain can never fit
+		if(count > I2C_QUEUE_LEN - 1) return I2C_ERR_BUSY;
+
+		for(uint8_t k = 0; k < count; k++) while(I2C_WC_BEFORE(&xfers[k]) == I2C_ERR_BUSY);
+
+		// A full queue only means the engine is busy, wait for room
+		while(i2c_submit_n(xfers, count) != I2C_OK);
+
+		i2c_err_t i2c_ret = I2C_OK;
+		for(uint8_t k = 0; k < count; k++)
+		{
+			i2c_err_t err = i2c_wait(&xfers[k]);
+			if(i2c_ret == I2C_OK) i2c_ret = err;
+		}
+		return i2c_ret;
+	}
+	#endif
+
+	#ifndef I2C_USE_IRQ
+	// The bus is owned for the whole chain, deferred transfers run after it
+	if(!i2c_lock()) return I2C_ERR_BUSY;
+	#endif
+
+	// A merged write for any link goes out before the chain, not inside it
+	for(uint8_t k = 0; k < count; k++) while(I2C_WC_BEFORE(&xfers[k]) == I2C_ERR_BUSY);
+
+	#if defined(I2C_USE_SPEEDS) && !defined(I2C_USE_IRQ)
+	// The first link loads the clock of the slowest one, for the whole chain.
+	// The engine works this out itself in IRQ Mode
+	uint32_t rate = 0xFFFFFFFF;
+	uint16_t ckcfgr = 0;
+	for(uint8_t k = 0; k < count; k++)
+		i2c_speed_slowest((xfers[0].bus != NULL) ? xfers[0].bus : i2c_bus,
+		                  xfers[k].addr, &rate, &ckcfgr);
+	i2c_speed_hold = ckcfgr;
+	#endif
+
+	i2c_err_t i2c_ret = i2c_chain_once(xfers, count);
+
+	#ifdef I2C_USE_RETRY
+	// A failed chain is run again from its first link, as often as the
+	// first link allows, backing off like i2c_xfer()
+	uint32_t backoff = I2C_RETRY_BACKOFF_US;
+	for(uint8_t attempt = 0; i2c_ret != I2C_OK && attempt < xfers[0].retries; attempt++)
+	{
+		uint8_t action = i2c_retry_action(i2c_ret);
+		if(action == 0) break;
+		if(action == 2) i2c_recover_bus();
+		I2C_STATS_RETRY(&xfers[0]);
+
+		Delay_Us(backoff);
+		backoff <<= 1;
+
+		i2c_ret = i2c_chain_once(xfers, count);
+	}
+	#endif
+
+	#ifndef I2C_USE_IRQ
+	#ifdef I2C_USE_SPEEDS
+	i2c_speed_hold = 0;
+	#endif
+	i2c_unlock();
+	#endif
+	return i2c_ret;
+}
+
+
+#ifdef I2C_USE_SPEEDS
+/// @brief Sets the bus clock of a device on a given bus, see i2c_set_speed
+/// @param bus Bus the device is on
+/// @param addr 7 Bit Device Address
+/// @param clk_rate bus clock for the device in Hz. 0 = use the bus clock
+/// @return i2c_err_t. I2C_OK on success, I2C_ERR_BUSY if the table is full
+static i2c_err_t i2c_speed_set(const i2c_bus_t *bus, const uint8_t addr,
+                               const uint32_t clk_rate)
+{
+	i2c_speed_t *speed = i2c_speed_find(bus, addr);
+
+	// Rate 0 gives the device back to the bus clock
+	if(clk_rate == 0)
+	{
+		if(speed != NULL) speed->addr = 0;
+		return I2C_OK;
+	}
+
+	if(speed == NULL) speed = i2c_speed_find(bus, 0);
+	if(speed == NULL) return I2C_ERR_BUSY;
+
+	uint16_t ckcfgr;
+	uint32_t clk_real = i2c_clk_plan(clk_rate, &ckcfgr);
+	speed->ckcfgr     = ckcfgr;
+	speed->clk_rate   = clk_rate;
+	speed->byte_ticks = (9 * Ticks_from_Us(1000000) + clk_real - 1) / clk_real;
+	speed->bus        = bus;
+	speed->addr       = addr;
+	return I2C_OK;
+}
+
+
+i2c_err_t i2c_set_speed(const uint8_t addr, const uint32_t clk_rate)
+{
+	return i2c_speed_set(i2c_bus, addr, clk_rate);
+}
+
+
+uint32_t i2c_speed_switches(uint32_t *ticks)
+{
+	if(ticks != NULL) *ticks = i2c_speed_ticks;
+	return i2c_speed_loads;
+}
+
+
+uint8_t i2c_speed_list(uint8_t *addrs, uint32_t *rates)
+{
+	uint8_t count = 0;
+	for(uint8_t s = 0; s < I2C_SPEED_SLOTS; s++)
+	{
+		if(i2c_speeds[s].addr == 0 || i2c_speeds[s].bus != i2c_bus) continue;
+		addrs[count] = i2c_speeds[s].addr;
+		rates[count] = i2c_speeds[s].clk_rate;
+		count++;
+	}
+	return count;
+}
+
+
+uint32_t i2c_calibrate(i2c_xfer_t *probe, const uint8_t trials)
+{
+	static const uint32_t ladder[] = I2C_CLK_LADDER;
+	const uint8_t steps = sizeof(ladder) / sizeof(ladder[0]);
+	const i2c_bus_t *bus = (probe->bus != NULL) ? probe->bus : i2c_bus;
+	const uint32_t bus_rate = bus->clk_rate;
+	// A rate has to pass at least one trial
+	const uint8_t need = (trials != 0) ? trials : 1;
+
+	uint8_t ref[I2C_CALIB_READ_MAX];
+	uint8_t retries = probe->retries;
+	if(probe->rlen > I2C_CALIB_READ_MAX) return 0;
+
+	// Failed trials are expected, keep them out of the statistics, and do
+	// not let retries hide them
+	I2C_STATS_PAUSE(1);
+	probe->retries = 0;
+
+	// Reference read at the bus clock. A device that fails it is left alone
+	uint32_t found = 0;
+	i2c_speed_set(bus, probe->addr, 0);
+	if(i2c_xfer(probe) == I2C_OK)
+	{
+		if(probe->rlen) memcpy(ref, probe->rbuf, probe->rlen);
+		found = bus_rate;
+
+		// Up from the bus clock, stopping at the first rate that fails, so
+		// a device is never left on a rate past one it could not keep up
+		// with. Rates at or below the bus clock prove nothing new
+		for(uint8_t step = 0; step < steps; step++)
+		{
+			#ifdef I2C_USE_SOFT
+			// Software busses run at their own clock, there is nothing to find
+			if(bus->soft) break;
+			#endif
+			if(ladder[step] <= bus_rate) continue;
+			if(i2c_speed_set(bus, probe->addr, ladder[step]) != I2C_OK) break;
+
+			uint8_t trial = 0;
+			for(; trial < need; trial++)
+			{
+				// Poison every byte against its own reference, so a short
+				// read can not pass
+				for(uint16_t i = 0; i < probe->rlen; i++) probe->rbuf[i] = ~ref[i];
+				i2c_err_t i2c_ret = i2c_xfer(probe);
+				if(i2c_ret != I2C_OK)
+				{
+					// Too fast a clock can leave a slave holding SDA
+					if(i2c_ret != I2C_ERR_NACK) i2c_recover();
+					break;
+				}
+				if(memcmp(probe->rbuf, ref, probe->rlen) != 0) break;
+			}
+			if(trial != need) break;
+			found = ladder[step];
+		}
+
+		// Back to the fastest rate that held up
+		i2c_speed_set(bus, probe->addr, (found == bus_rate) ? 0 : found);
+	}
+
+	probe->retries = retries;
+	I2C_STATS_PAUSE(0);
+	return found;
+}
+
+
+uint8_t i2c_calibrate_all(const uint8_t trials)
+{
+	uint8_t faster = 0;
+	i2c_xfer_t ping = {0};
+
+	for(uint8_t addr = I2C_ADDR_FIRST; addr <= I2C_ADDR_LAST; addr++)
+	{
+		if(!i2c_is_present(addr)) continue;
+		ping.addr = addr;
+		if(i2c_calibrate(&ping, trials) > i2c_bus->clk_rate) faster++;
+	}
+	return faster;
+}
+#endif
+
+
+#ifdef I2C_USE_PEC
+uint8_t i2c_crc8(uint8_t crc, const uint8_t *buf, const uint16_t len)
+{
+	for(uint16_t i = 0; i < len; i++)
+	{
+		crc ^= buf[i];
+		for(uint8_t bit = 0; bit < 8; bit++)
+			crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+	}
+	return crc;
+}
+#endif
+
+
+#ifdef I2C_USE_COALESCE
+i2c_err_t i2c_write_coalesce(const uint8_t addr, const uint8_t reg,
+                             const uint8_t *buf, const uint16_t len)
+{
+	i2c_wc_writes++;
+
+	if(i2c_wc_len != 0)
+	{
+		// The run of registers the merged write would cover
+		uint16_t lo = (reg < i2c_wc_reg) ? reg : i2c_wc_reg;
+		uint16_t hi = I2C_MAX(reg + len, i2c_wc_reg + i2c_wc_len);
+
+		if(addr != i2c_wc_addr || i2c_bus != i2c_wc_bus ||
+		   reg > i2c_wc_reg + i2c_wc_len || reg + len < i2c_wc_reg ||
+		   hi - lo > I2C_COALESCE_MAX || I2C_WC_DUE())
+		{
+			// A busy bus leaves it pending, it goes out with a later flush.
+			// Any error is kept until the end, returned with this write
+			i2c_err_t fl_ret = i2c_coalesce_flush();
+			if(fl_ret == I2C_ERR_BUSY) return I2C_ERR_BUSY;
+			if(i2c_wc_err == I2C_OK) i2c_wc_err = fl_ret;
+		}
+	}
+
+	// Too big to ever merge, send it as it is
+	if(len > I2C_COALESCE_MAX)
+	{
+		i2c_wc_xfers++;
+		i2c_err_t wr_ret = i2c_write(addr, reg, buf, len);
+		i2c_err_t wc_ret = i2c_wc_take();
+		return (wc_ret != I2C_OK) ? wc_ret : wr_ret;
+	}
+
+	// Another context may drain the buffer while it is changed, through a
+	// transfer to the same device. Interrupts are off from here on, and a
+	// merged write still on its way out is waited for first
+	uint8_t irq;
+	while(1)
+	{
+		I2C_WC_IDLE();
+		irq = i2c_irq_mask();
+		#ifdef I2C_USE_IRQ
+		if(i2c_wc_len == 0 && i2c_wc_xfer.busy) {i2c_irq_restore(irq); continue;}
+		#endif
+		break;
+	}
+
+	if(i2c_wc_len == 0)
+	{
+		i2c_wc_bus  = i2c_bus;
+		i2c_wc_addr = addr;
+		i2c_wc_reg  = reg;
+		i2c_wc_len  = len;
+		i2c_wc_deadline = SysTick->CNT + Ticks_from_Us(I2C_COALESCE_US);
+		memcpy(i2c_wc_buf, buf, len);
+	}
+	else
+	{
+		// Grow the run downwards, then lay the new bytes over it
+		if(reg < i2c_wc_reg)
+		{
+			uint8_t shift = i2c_wc_reg - reg;
+			memmove(&i2c_wc_buf[shift], i2c_wc_buf, i2c_wc_len);
+			i2c_wc_reg  = reg;
+			i2c_wc_len += shift;
+		}
+		memcpy(&i2c_wc_buf[reg - i2c_wc_reg], buf, len);
+		if(reg + len - i2c_wc_reg > i2c_wc_len) i2c_wc_len = reg + len - i2c_wc_reg;
+	}
+	i2c_irq_restore(irq);
+
+	return i2c_wc_take();
+}
+
+
+i2c_err_t i2c_coalesce_flush(void)
+{
+	#ifndef I2C_USE_IRQ
+	if(!i2c_lock()) return I2C_ERR_BUSY;
+	i2c_wc_drain();
+	i2c_unlock();
+	#else
+	// Queued, then waited for, so its result can be returned
+	if(i2c_wc_drain() == I2C_ERR_BUSY) return I2C_ERR_BUSY;
+	I2C_WC_IDLE();
+	#endif
+	return i2c_wc_take();
+}
+
+
+i2c_err_t i2c_coalesce_poll(void)
+{
+	if(i2c_wc_len != 0 && I2C_WC_DUE()) return i2c_coalesce_flush();
+	return I2C_OK;
+}
+
+
+uint32_t i2c_coalesce_stats(uint32_t *xfers)
+{
+	if(xfers != NULL) *xfers = i2c_wc_xfers;
+	return i2c_wc_writes;
+}
+#endif
+
+
+#ifdef I2C_USE_WFI
+uint32_t i2c_sleep_ticks(void)
+{
+	return i2c_slept;
+}
+#endif
+
+
+#ifdef I2C_USE_STATS
+const i2c_stats_t *i2c_stats_get(const uint8_t addr)
+{
+	for(uint8_t s = 0; s <= I2C_STATS_SLOTS; s++)
+		if(i2c_stats[s].addr == addr) return &i2c_stats[s];
+	return NULL;
+}
+
+
+void i2c_stats_reset(void)
+{
+	#ifdef I2C_USE_IRQ
+	NVIC_DisableIRQ(I2C1_EV_IRQn);
+	NVIC_DisableIRQ(I2C1_ER_IRQn);
+	#endif
+
+	for(uint8_t s = 0; s <= I2C_STATS_SLOTS; s++) i2c_stats[s] = (i2c_stats_t){0};
+
+	#ifdef I2C_USE_IRQ
+	NVIC_EnableIRQ(I2C1_EV_IRQn);
+	NVIC_EnableIRQ(I2C1_ER_IRQn);
+	#endif
+}
+
+
+void i2c_stats_print(void)
+{
+	for(uint8_t s = 0; s <= I2C_STATS_SLOTS; s++)
+	{
+		const i2c_stats_t *st = &i2c_stats[s];
+		if(st->addr == 0) continue;
+
+		printf("I2C 0x%02X  xfers: %lu  wr: %lu  rd: %lu  nack: %d  arlo: %d  "
+		       "tout: %d  err: %d  retry: %d\n", st->addr, st->xfers, st->wbytes,
+		       st->rbytes, st->nack, st->arlo, st->timeout, st->other, st->retries);
+
+		uint32_t avg = st->xfers ? st->ticks_sum / st->xfers : 0;
+		printf("    avg: %lu us  max: %lu us  hist:", avg / DELAY_US_TIME,
+		       st->ticks_max / DELAY_US_TIME);
+		for(uint8_t bin = 0; bin < I2C_STATS_BINS; bin++) printf(" %d", st->hist[bin]);
+		printf("\n");
+	}
 }
+#endif
@@ -7,6 +7,12 @@
 * Alt 1:	SCL = PD1		SDA = PD0
 * Alt 2:	SCL = PC5		SDA = PC6
 *
+* I2C_PINOUT_* picks the pinout used by i2c_init(). Devices can also be spread
+* over several pinouts with i2c_bus_t handles, switched at runtime.
+*
+* Interrupt handlers (eg an RTC alarm on an EXTI pin) must request transfers
+* with i2c_defer(), they run once the main loop has released the bus.
+*
 * See GitHub Repo for more information: 
 * https://github.com/ADBeta/CH32V000x-lib_i2c
 *
@@ -42,6 +48,49 @@
 //#define I2C_PINOUT_ALT_1
 //#define I2C_PINOUT_ALT_2
 
+// Uncomment to move i2c_read/i2c_write payloads with DMA1 (CH6 = TX, CH7 = RX)
+// instead of spinning on TXE/RXNE. Can also be defined in funconfig.h
+//#define I2C_USE_DMA
+
+// Uncomment to run transfers from the I2C1_EV/I2C1_ER Interrupts. Transfers
+// are queued with i2c_submit(), the blocking functions submit and wait.
+// The IRQ engine moves bytes itself, I2C_USE_DMA is not used with it
+//#define I2C_USE_IRQ
+
+// Uncomment to add bit-banged software busses, on any two pins of a port.
+// They run from RAM and are used through i2c_bus_t handles, with the same
+// functions as the hardware bus. See I2C_BUS_SOFT()
+//#define I2C_USE_SOFT
+
+// Uncomment to keep per-address transfer statistics, see i2c_stats_get()
+// and i2c_stats_print(). Costs sizeof(i2c_stats_t) of RAM per slot
+//#define I2C_USE_STATS
+
+// Uncomment to let transfers be retried with exponential backoff, set per
+// transfer with xfer->retries. Stuck busses are recovered between attempts
+//#define I2C_USE_RETRY
+
+// Uncomment to let busses sleep in WFI while a transfer waits on the bus,
+// instead of spinning. Chosen per bus with bus->sleep. The SysTick compare
+// is used as the wake-up alarm for timeouts, so a SysTick Interrupt can not
+// be used with it
+//#define I2C_USE_WFI
+
+// Uncomment to run devices at their own bus clock, set with i2c_set_speed().
+// CKCFGR is reloaded between transfers, only when the speed changes
+//#define I2C_USE_SPEEDS
+
+// Uncomment to allow SMBus Packet Error Checking, per transfer with the
+// I2C_XFER_PEC flag. Hardware busses have the Peripheral add and check the
+// CRC-8, software busses work it out with i2c_crc8()
+//#define I2C_USE_PEC
+
+// Uncomment to add a write-combining buffer. Small register writes made with
+// i2c_write_coalesce() to one device are merged, keeping the last value of
+// each register, and sent as one transfer when the window runs out, another
+// device or a non-adjacent register is written, or i2c_coalesce_flush()
+//#define I2C_USE_COALESCE
+
 /*** Hardware Definitions ****************************************************/
 // Predefined Clock Speeds
 #define I2C_CLK_10KHZ  10000
@@ -53,9 +102,200 @@
 #define I2C_CLK_750KHZ 750000
 #define I2C_CLK_1MHZ   1000000
 
-// Hardware CLK Prerate and timeout
+// Hardware CLK Prerate
 #define I2C_PRERATE 1000000
-#define I2C_TIMEOUT 2000
+
+// Rise time of SCL in nanoseconds (10% - 90%), set by the pull-ups and bus
+// capacitance. The Peripheral only starts timing the high half of SCL once
+// it sees the line high, so the rise time adds to every clock period. 4.7K
+// pull-ups with about 50pF of bus give roughly 200ns
+#ifndef I2C_TRISE_NS
+#define I2C_TRISE_NS 200
+#endif
+
+/*** Clock Planner ***********************************************************/
+// Picks CCR and DUTY for the fastest rate at or below the request, keeping
+// the tLOW/tHIGH minimums of the speed mode (Sm, Fm, Fm+), with the rise
+// time taken out of each period. These are constant expressions, so they
+// work out at compile time for constant rates. Clocks are PCLK (core) cycles
+#define I2C_DIV_UP(a, b)     (((a) + (b) - 1) / (b))
+#define I2C_MAX(a, b)        ((a) > (b) ? (a) : (b))
+#define I2C_NS_CYC(ns)       I2C_DIV_UP((ns) * (FUNCONF_SYSTEM_CORE_CLOCK / 1000000), 1000)
+#define I2C_TRISE_CYC        I2C_NS_CYC(I2C_TRISE_NS)
+
+// Spec minimums of SCL low and high time, in ns, for the mode of a rate
+#define I2C_TLOW_NS(rate)    ((rate) <= 100000 ? 4700 : (rate) <= 400000 ? 1300 : 500)
+#define I2C_THIGH_NS(rate)   ((rate) <= 100000 ? 4000 : (rate) <= 400000 ? 600  : 260)
+
+// Cycles of one period left for CCR to fill, after the rise time
+#define I2C_PERIOD_CYC(rate) (I2C_DIV_UP(FUNCONF_SYSTEM_CORE_CLOCK, (rate)) - I2C_TRISE_CYC)
+
+// CCR for each timing. Standard: low = high = CCR. Fast 2:1: low = 2 CCR,
+// high = CCR. Fast 16:9 (DUTY): low = 16 CCR, high = 9 CCR
+#define I2C_CCR_SM(rate)     I2C_MAX(I2C_MAX(I2C_DIV_UP(I2C_PERIOD_CYC(rate), 2), 4), \
+                             I2C_NS_CYC(I2C_TLOW_NS(rate)))
+#define I2C_CCR_FM(rate)     I2C_MAX(I2C_MAX(I2C_DIV_UP(I2C_PERIOD_CYC(rate), 3), 1), \
+                             I2C_MAX(I2C_DIV_UP(I2C_NS_CYC(I2C_TLOW_NS(rate)), 2), \
+                             I2C_NS_CYC(I2C_THIGH_NS(rate))))
+#define I2C_CCR_FM169(rate)  I2C_MAX(I2C_MAX(I2C_DIV_UP(I2C_PERIOD_CYC(rate), 25), 1), \
+                             I2C_MAX(I2C_DIV_UP(I2C_NS_CYC(I2C_TLOW_NS(rate)), 16), \
+                             I2C_DIV_UP(I2C_NS_CYC(I2C_THIGH_NS(rate)), 9)))
+
+// 16:9 is used when it gives a shorter period than 2:1
+#define I2C_USE_DUTY(rate)   (25 * I2C_CCR_FM169(rate) < 3 * I2C_CCR_FM(rate))
+
+// Cycles of CCR time in one period
+#define I2C_CCR_CYC(rate)    ((rate) <= 100000   ? 2 * I2C_CCR_SM(rate)    : \
+                              I2C_USE_DUTY(rate) ? 25 * I2C_CCR_FM169(rate) : \
+                                                   3 * I2C_CCR_FM(rate))
+
+/// CKCFGR value for a rate
+#define I2C_CKCFGR_PLAN(rate) ((rate) <= 100000 ? (I2C_CCR_SM(rate) & I2C_CKCFGR_CCR) : \
+                              I2C_USE_DUTY(rate) ? ((I2C_CCR_FM169(rate) & I2C_CKCFGR_CCR) \
+                                                   | I2C_CKCFGR_FS | I2C_CKCFGR_DUTY) : \
+                              ((I2C_CCR_FM(rate) & I2C_CKCFGR_CCR) | I2C_CKCFGR_FS))
+
+/// Bus clock, in Hz, that a requested rate really runs at
+#define I2C_CLK_REAL(rate)   (FUNCONF_SYSTEM_CORE_CLOCK / (I2C_CCR_CYC(rate) + I2C_TRISE_CYC))
+
+// The Predefined Clock Speeds, and what they really run at on this
+// FUNCONF_SYSTEM_CORE_CLOCK, eg static const uint32_t real[] = I2C_CLK_TABLE;
+#define I2C_CLK_LADDER {I2C_CLK_10KHZ, I2C_CLK_50KHZ, I2C_CLK_100KHZ, I2C_CLK_400KHZ, \
+                        I2C_CLK_500KHZ, I2C_CLK_600KHZ, I2C_CLK_750KHZ, I2C_CLK_1MHZ}
+#define I2C_CLK_TABLE  {I2C_CLK_REAL(I2C_CLK_10KHZ),  I2C_CLK_REAL(I2C_CLK_50KHZ),  \
+                        I2C_CLK_REAL(I2C_CLK_100KHZ), I2C_CLK_REAL(I2C_CLK_400KHZ), \
+                        I2C_CLK_REAL(I2C_CLK_500KHZ), I2C_CLK_REAL(I2C_CLK_600KHZ), \
+                        I2C_CLK_REAL(I2C_CLK_750KHZ), I2C_CLK_REAL(I2C_CLK_1MHZ)}
+
+// Transfer timeout budget in microseconds, timed with SysTick->CNT so it
+// does not depend on the core clock or optimisation level. Every transfer
+// gets I2C_TIMEOUT_US, plus I2C_TIMEOUT_BYTES byte-times at the bus clock
+// for each byte it moves. xfer->timeout_us overrides the whole budget
+#ifndef I2C_TIMEOUT_US
+#define I2C_TIMEOUT_US    2000
+#endif
+#ifndef I2C_TIMEOUT_BYTES
+#define I2C_TIMEOUT_BYTES 4
+#endif
+
+// The IRQ engine moves its own bytes
+#if defined(I2C_USE_IRQ) && defined(I2C_USE_DMA)
+	#undef I2C_USE_DMA
+#endif
+
+// DMA Transfer Settings
+#ifdef I2C_USE_DMA
+	// Payloads shorter than this are polled, DMA setup is not free
+	#ifndef I2C_DMA_THRESHOLD
+	#define I2C_DMA_THRESHOLD 8
+	#endif
+
+	// Run repeatedly while DMA moves the payload. Define it as __WFI() with a
+	// DMA IRQ enabled, or point it at background work
+	#ifndef I2C_DMA_WAIT_HOOK
+	#define I2C_DMA_WAIT_HOOK()
+	#endif
+#endif
+
+// Bus Recovery and Retry Settings
+// Half period of the bit-banged recovery clock, 5us = 100KHz
+#ifndef I2C_RECOVER_HALF_US
+#define I2C_RECOVER_HALF_US 5
+#endif
+#ifdef I2C_USE_RETRY
+	// Wait before the first retry, doubled for every retry after it
+	#ifndef I2C_RETRY_BACKOFF_US
+	#define I2C_RETRY_BACKOFF_US 100
+	#endif
+#endif
+
+// Bus Scan Settings
+// Addresses outside 0x08 - 0x77 are reserved by the I2C spec, never scanned
+#define I2C_ADDR_FIRST 0x08
+#define I2C_ADDR_LAST  0x77
+// Each scan ping gets 4 byte-times plus this slack as its deadline. Empty
+// addresses NACK after the address byte, the deadline only catches hangs
+#ifndef I2C_SCAN_SLACK_US
+#define I2C_SCAN_SLACK_US 50
+#endif
+
+// Software Bus Settings
+#ifdef I2C_USE_SOFT
+	// Core cycles of one pass of the delay loop, and of the pin handling in
+	// each half bit. Tune these if the measured clock is off
+	#ifndef I2C_SOFT_LOOP_CYCLES
+	#define I2C_SOFT_LOOP_CYCLES 4
+	#endif
+	#ifndef I2C_SOFT_OVERHEAD
+	#define I2C_SOFT_OVERHEAD    10
+	#endif
+#endif
+
+// Sleep Settings
+#ifdef I2C_USE_WFI
+	// Polled transfers spin for 1/I2C_WFI_SPIN_DIV of a byte-time before
+	// sleeping, so waits shorter than a byte never pay for the wake-up
+	#ifndef I2C_WFI_SPIN_DIV
+	#define I2C_WFI_SPIN_DIV 8
+	#endif
+#endif
+
+// Speed Table Settings
+#ifdef I2C_USE_SPEEDS
+	// Number of devices that can have their own bus clock
+	#ifndef I2C_SPEED_SLOTS
+	#define I2C_SPEED_SLOTS 4
+	#endif
+	// Largest read-back an i2c_calibrate() probe can check
+	#ifndef I2C_CALIB_READ_MAX
+	#define I2C_CALIB_READ_MAX 8
+	#endif
+#endif
+
+// Write Coalescing Settings
+#ifdef I2C_USE_COALESCE
+	// Largest run of registers the buffer can merge, in bytes
+	#ifndef I2C_COALESCE_MAX
+	#define I2C_COALESCE_MAX 16
+	#endif
+	// Longest a merged write is held back for, in us, counted from the first
+	// write that went into it. 0 holds it until a conflict or a flush
+	#ifndef I2C_COALESCE_US
+	#define I2C_COALESCE_US 1000
+	#endif
+#endif
+
+// Statistics Settings
+#ifdef I2C_USE_STATS
+	// Number of addresses tracked. Later addresses share the overflow slot
+	#ifndef I2C_STATS_SLOTS
+	#define I2C_STATS_SLOTS 4
+	#endif
+	// Latency histogram bins. Bin 0 is under 64us, each bin after doubles,
+	// the last bin holds everything longer
+	#ifndef I2C_STATS_BINS
+	#define I2C_STATS_BINS 8
+	#endif
+	// Address of the overflow slot, for addresses that did not get a slot
+	#define I2C_STATS_OTHER 0xFF
+#endif
+
+// Bus Ownership Settings
+#ifndef I2C_USE_IRQ
+	// Number of transfers Interrupt handlers can defer with i2c_defer()
+	// while the bus is owned. Must be a power of 2
+	#ifndef I2C_DEFER_LEN
+	#define I2C_DEFER_LEN 4
+	#endif
+#endif
+
+// Interrupt Engine Settings
+#ifdef I2C_USE_IRQ
+	// Number of transfers that can be queued. Must be a power of 2
+	#ifndef I2C_QUEUE_LEN
+	#define I2C_QUEUE_LEN 4
+	#endif
+#endif
 
 // Default Pinout
 #ifdef I2C_PINOUT_DEFAULT
@@ -84,6 +324,48 @@
 	#define I2C_PIN_SDA 	6
 #endif
 
+// Bus Handle. Everything that differs between the pin pairs the one I2C1
+// Peripheral can be muxed to. Fill in the pinout and clk_rate with one of
+// the I2C_BUS_* initialisers, the rest is worked out by i2c_bus_init()
+typedef struct i2c_bus {
+	uint32_t      afio;        // AFIO->PCFR1 I2C1 Remap bits
+	uint32_t      port_rcc;    // RCC_APB2Periph_GPIOx of the port
+	GPIO_TypeDef *port;
+	uint8_t       pin_scl;
+	uint8_t       pin_sda;
+	uint32_t      clk_rate;    // Requested bus clock in Hz
+	uint32_t      timeout_us;  // Base transfer timeout, 0 = I2C_TIMEOUT_US
+	uint16_t      ckcfgr;      // Set by i2c_bus_init(). CKCFGR for clk_rate
+	uint32_t      clk_real;    // Set by i2c_bus_init(). Bus clock it runs at
+	uint32_t      byte_ticks;  // Set by i2c_bus_init(). SysTick ticks per byte
+	#ifdef I2C_USE_SOFT
+	uint8_t       soft;        // 1 = Bit-banged bus, afio is not used
+	uint16_t      soft_delay;  // Set by i2c_bus_init(). Half bit delay loops
+	#endif
+	#ifdef I2C_USE_WFI
+	uint8_t       sleep;       // 1 = Sleep in WFI while waiting on the bus
+	#endif
+} i2c_bus_t;
+
+// Bus Handle Initialisers for each hardware pinout, and for the one
+// selected by I2C_PINOUT_*
+#define I2C_BUS_DEFAULT(clk) {.afio = 0x00000000, .port_rcc = RCC_APB2Periph_GPIOC, \
+                              .port = GPIOC, .pin_scl = 2, .pin_sda = 1, .clk_rate = (clk)}
+#define I2C_BUS_ALT_1(clk)   {.afio = 0x04000002, .port_rcc = RCC_APB2Periph_GPIOD, \
+                              .port = GPIOD, .pin_scl = 1, .pin_sda = 0, .clk_rate = (clk)}
+#define I2C_BUS_ALT_2(clk)   {.afio = 0x00400002, .port_rcc = RCC_APB2Periph_GPIOC, \
+                              .port = GPIOC, .pin_scl = 5, .pin_sda = 6, .clk_rate = (clk)}
+#define I2C_BUS_PINOUT(clk)  {.afio = I2C_AFIO_REG, .port_rcc = I2C_PORT_RCC, \
+                              .port = I2C_PORT, .pin_scl = I2C_PIN_SCL, \
+                              .pin_sda = I2C_PIN_SDA, .clk_rate = (clk)}
+
+#ifdef I2C_USE_SOFT
+// Bus Handle Initialiser for a software bus, on pins 0 - 7 of one port.
+// eg I2C_BUS_SOFT(GPIOD, RCC_APB2Periph_GPIOD, 4, 5, I2C_CLK_1MHZ)
+#define I2C_BUS_SOFT(gpio, rcc, scl, sda, clk) {.port_rcc = (rcc), .port = (gpio), \
+                              .pin_scl = (scl), .pin_sda = (sda), .clk_rate = (clk), .soft = 1}
+#endif
+
 // Error Code Definitons
 typedef enum {
 	I2C_OK	  = 0,  // No Error. All OK
@@ -92,33 +374,361 @@ typedef enum {
 	I2C_ERR_ARLO,	 // Arbitration Lost
 	I2C_ERR_OVR,	  // Overun/underrun condition
 	I2C_ERR_BUSY,	 // Bus was busy and timed out
+	I2C_ERR_TIMEOUT, // A transfer ran past its deadline
+	I2C_ERR_PEC,     // Received PEC did not match the data
 } i2c_err_t;
 
+// Transfer Flags
+#define I2C_XFER_NOSTOP  0x01   // Keep the bus, the next transfer starts with a
+                                // repeated START instead of STOP + START
+#ifdef I2C_USE_PEC
+#define I2C_XFER_PEC     0x02   // Append a PEC byte to writes, and check the
+                                // one after reads. The device must support it.
+                                // Not moved by DMA
+#endif
+
+// Write Segment, for scatter-gather writes
+typedef struct {
+	const uint8_t *buf;
+	uint16_t       len;
+} i2c_iovec_t;
+
+// Transfer Descriptor. Writes [reg_len] bytes of [reg], then each of the
+// [wvec_len] segments of [wvec], then [wlen] bytes of [wbuf] to [addr], as
+// one stream with no copies. If [rlen] is set, a repeated START follows and
+// [rlen] bytes are read into [rbuf]. With nothing to write, only the read
+// is done. Streamed reads set [rchunk] too: [rbuf] is then a ring of
+// [rchunk] bytes, handed to [on_chunk] each time it fills, so a read can be
+// far longer than the RAM it goes through
+typedef struct i2c_xfer {
+	uint8_t          addr;      // 7 Bit Device Address
+	uint8_t          flags;     // I2C_XFER_* Flags
+	uint8_t          reg_len;   // Number of register prefix bytes, 0 - 4
+	uint8_t          reg[4];    // Register prefix, reg[0] is sent first
+	const i2c_iovec_t *wvec;    // Write segments, can be NULL if wvec_len is 0
+	uint8_t          wvec_len;
+	const uint8_t   *wbuf;      // Write payload, can be NULL if wlen is 0
+	uint16_t         wlen;
+	uint8_t         *rbuf;      // Read payload, can be NULL if rlen is 0
+	uint16_t         rlen;
+	uint16_t         rchunk;    // Size of rbuf for streamed reads, 0 = not streamed
+	uint16_t         rfill;     // Bytes in rbuf not handed on yet. Used by lib_i2c
+	// Streamed reads: called with each full rbuf, and what is left at the
+	// end. Returning 0 ends the read early: the next byte is already being
+	// clocked by then, so at least one more byte is ACKed or NACKed, read
+	// and dropped, more if it runs longer than a byte time. NULL = the ring
+	// is written over. Runs in the Interrupt in IRQ mode, keep it short
+	uint8_t (*on_chunk)(struct i2c_xfer *, const uint8_t *buf, const uint16_t len);
+	uint32_t         timeout_us; // Deadline for the whole transfer, 0 = default
+	uint8_t          retries;    // Extra attempts on failure (I2C_USE_RETRY)
+	i2c_bus_t       *bus;        // Bus to run on, NULL = the current bus
+	// Called when the transfer finishes (from the Interrupt in IRQ mode)
+	void (*callback)(struct i2c_xfer *);
+	volatile uint8_t   busy;    // Set while queued or running
+	volatile i2c_err_t err;     // Result, valid once busy is cleared
+} i2c_xfer_t;
+
+#ifdef I2C_USE_STATS
+// Per-address Statistics. Every attempt at a transfer counts as one xfer,
+// times are in SysTick ticks (DELAY_US_TIME ticks per microsecond)
+typedef struct {
+	uint8_t  addr;          // Device Address, 0 = slot unused
+	uint32_t xfers;         // Transfers attempted
+	uint32_t wbytes;        // Bytes written, by transfers that succeeded
+	uint32_t rbytes;        // Bytes read, by transfers that succeeded
+	uint16_t nack;
+	uint16_t arlo;
+	uint16_t timeout;
+	uint16_t other;         // BERR, OVR and BUSY
+	uint16_t retries;
+	uint32_t ticks_sum;     // Time on the bus, add up / max of every xfer
+	uint32_t ticks_max;
+	uint16_t hist[I2C_STATS_BINS];
+} i2c_stats_t;
+#endif
+
+// Address range for i2c_scan_ranges, both ends included
+typedef struct {
+	uint8_t first;
+	uint8_t last;
+} i2c_range_t;
+
 
 /*** Functions ***************************************************************/
 /// @brief Initialise the I2C Peripheral on the default pins, in Master Mode
-/// @param clk_rate that the I2C Bus should use in Hz. Max 400000
+/// @param clk_rate that the I2C Bus should use in Hz. The bus runs at the
+/// fastest rate at or below it, see i2c_clk_plan()
 /// @return i2c_err_t, I2C_OK On success
 i2c_err_t i2c_init(const uint32_t clk_rate);
 
-/// @brief Pings a specific I2C Address, and returns a i2c_err_t status
-/// @param addr I2C Device Address, MUST BE 7 Bit
-/// @return i2c_err_t, I2C_OK if the device responds
-i2c_err_t i2c_ping(const uint8_t addr);
+/// @brief Works out the CKCFGR setting for a bus clock, see Clock Planner
+/// @param clk_rate, requested bus clock in Hz
+/// @param ckcfgr, where to store the CKCFGR value, can be NULL
+/// @return uint32_t, the bus clock it really gives, in Hz
+uint32_t i2c_clk_plan(const uint32_t clk_rate, uint16_t *ckcfgr);
+
+/// @brief Initialise the I2C Peripheral in Master Mode, on the pins of [bus].
+/// Also runs i2c_bus_init() on [bus]
+/// @param bus, Hardware Bus Handle to start on
+/// @return i2c_err_t, I2C_OK On success
+i2c_err_t i2c_init_bus(i2c_bus_t *bus);
+
+/// @brief Works out the clock settings and byte time of a Bus Handle, and
+/// enables its GPIO Port. Run it once on every handle before using it, and
+/// again if clk_rate changes. Software busses have their pins set up here
+/// @param bus, Bus Handle with the pinout and clk_rate filled in
+/// @return None
+void i2c_bus_init(i2c_bus_t *bus);
+
+/// @brief Switches I2C1 over to another bus. The old pins are released,
+/// AFIO is remapped and the clock reloaded, without resetting the
+/// Peripheral. Must be called between transfers, after i2c_init(). Transfers
+/// with xfer->bus set do this themselves, in IRQ mode that is the only safe
+/// way. Selecting a software bus does not touch I2C1
+/// @param bus, Bus Handle, set up with i2c_bus_init()
+/// @return None
+void i2c_bus_select(i2c_bus_t *bus);
+
+/// @brief Gets the Bus Handle I2C1 is currently muxed to
+/// @param None
+/// @return i2c_bus_t *, the current bus
+i2c_bus_t *i2c_bus_current(void);
 
-/// @brief Scans through all 7 Bit addresses, prints any that respond
-/// @param callback function - returns void, takes uint8_t
+/// @brief Frees a bus held by a Slave that lost track of a transfer (eg
+/// after a brown-out or reset mid-transfer). Clocks SCL as a GPIO up to 9
+/// times until SDA is released, sends a manual STOP, then resets the I2C
+/// Peripheral through RCC and sets it up again with the i2c_init settings
+/// @param None
+/// @return i2c_err_t. I2C_OK if both lines are high afterwards, I2C_ERR_BUSY
+/// if something is still holding the bus
+i2c_err_t i2c_recover(void);
+
+/// @brief Scans through all non-reserved 7 Bit addresses (0x08 - 0x77) of
+/// the current bus, and records which ones respond in the presence table
+/// @param callback function - returns void, takes uint8_t. Called for every
+/// address that responds, can be NULL
 /// @return None
 void i2c_scan(void (*callback)(const uint8_t));
 
+/// @brief Scans only the addresses in [ranges], same rules as i2c_scan.
+/// Reserved addresses are skipped, presence of addresses outside the ranges
+/// is left as it was
+/// @param ranges, array of address ranges to ping
+/// @param count, number of ranges
+/// @param callback function - returns void, takes uint8_t. Can be NULL
+/// @return uint8_t, number of addresses that responded
+uint8_t i2c_scan_ranges(const i2c_range_t *ranges, const uint8_t count,
+                        void (*callback)(const uint8_t));
+
+/// @brief Looks up an address in the presence table of the last scan. No
+/// bus traffic
+/// @param addr, I2C Device Address, MUST BE 7 Bit
+/// @return uint8_t, 1 if the device responded to the last scan
+uint8_t i2c_is_present(const uint8_t addr);
+
+/// @brief Gets how long the last i2c_scan / i2c_scan_ranges took
+/// @param None
+/// @return uint32_t, scan time in microseconds
+uint32_t i2c_scan_time_us(void);
+
+/// @brief Runs a transfer described by [xfer] and waits for it to finish.
+/// Every other read/write function is a shim around this one.
+/// The calling context owns the bus until it returns. Called from an
+/// Interrupt handler that interrupted a transfer, it returns I2C_ERR_BUSY
+/// rather than corrupt it, handlers should use i2c_defer() instead
+/// @param xfer, Transfer Descriptor. busy, err and callback are updated
+/// @return i2c_err_t. I2C_OK On Success
+i2c_err_t i2c_xfer(i2c_xfer_t *xfer);
+
+/// @brief Requests a transfer from any context, Interrupt handlers included,
+/// without waiting for the bus. If the bus is owned the request is queued,
+/// and runs as soon as the owner releases the bus, otherwise it runs at once.
+/// In IRQ Mode it is queued with i2c_submit(). The result is reported
+/// through busy, err and callback. [xfer] must stay valid until then
+/// @param xfer, Transfer Descriptor to run
+/// @return i2c_err_t. I2C_OK if accepted, I2C_ERR_BUSY if the queue is full
+i2c_err_t i2c_defer(i2c_xfer_t *xfer);
+
+/// @brief Runs [count] transfers as one bus transaction. Each link is joined
+/// to the next by a repeated START, and only the last one sends a STOP, so
+/// a register snapshot over several devices can not be split by another
+/// Master. The links may address different devices, but must be on one bus.
+/// The first failing link ends the chain with a STOP, the links after it
+/// fail with the same error. Links are never retried on their own, that
+/// would split the transaction: the whole chain is run again from the first
+/// link, up to the first link's retries. In IRQ Mode the chain is queued
+/// whole, once there is room for it, and is not retried
+/// @param xfers, array of Transfer Descriptors. I2C_XFER_NOSTOP is set on
+/// every link but the last, and cleared on the last
+/// @param count, number of links
+/// @return i2c_err_t. The result of the first failing link, I2C_OK if none.
+/// In IRQ Mode, I2C_ERR_BUSY if it has more than I2C_QUEUE_LEN - 1 links
+i2c_err_t i2c_chain(i2c_xfer_t *xfers, const uint8_t count);
+
+#ifdef I2C_USE_IRQ
+/// @brief Queues a transfer for the Interrupt engine, and returns at once.
+/// [xfer] must stay valid until its busy flag clears or the callback runs
+/// @param xfer, Transfer Descriptor to run
+/// @return i2c_err_t. I2C_OK if queued, I2C_ERR_BUSY if the queue is full
+i2c_err_t i2c_submit(i2c_xfer_t *xfer);
+
+/// @brief Waits for a submitted transfer to finish. Only a transfer that
+/// runs past its own budget, timed from its own START, is failed with
+/// I2C_ERR_TIMEOUT. Transfers queued ahead of [xfer] are waited out
+/// @param xfer, Transfer Descriptor previously passed to i2c_submit()
+/// @return i2c_err_t. The result of the transfer
+i2c_err_t i2c_wait(i2c_xfer_t *xfer);
+#endif
+
+#ifdef I2C_USE_SPEEDS
+/// @brief Sets the bus clock a device on the current bus is run at, planned
+/// the same way as the bus clock. The same address on another bus is another
+/// device, select that bus to set its speed. Chains run at the speed of
+/// their slowest link, software busses always run at their own clock
+/// @param addr, 7 Bit Device Address
+/// @param clk_rate, bus clock for the device in Hz. 0 = use the bus clock
+/// @return i2c_err_t. I2C_OK on success, I2C_ERR_BUSY if the table is full
+i2c_err_t i2c_set_speed(const uint8_t addr, const uint32_t clk_rate);
+
+/// @brief Gets how often CKCFGR was reloaded to change speed, and the time
+/// spent doing it. Both run freely
+/// @param ticks, where to store the SysTick ticks spent, can be NULL
+/// @return uint32_t, number of reloads
+uint32_t i2c_speed_switches(uint32_t *ticks);
+
+/// @brief Copies out the speed table entries of the current bus, to save
+/// them, eg to an EEPROM. Restore them by calling i2c_set_speed() for each
+/// entry with the same bus selected
+/// @param addrs, where to store the addresses, I2C_SPEED_SLOTS long
+/// @param rates, where to store their clocks in Hz, I2C_SPEED_SLOTS long
+/// @return uint8_t, number of entries stored
+uint8_t i2c_speed_list(uint8_t *addrs, uint32_t *rates);
+
+/// @brief Finds the fastest I2C_CLK_LADDER rate a device works at on this
+/// board. [probe] is run once at the bus clock for reference, then [trials]
+/// times at each faster rate, slowest first, until a rate fails. A rate
+/// passes when every trial succeeds and reads back the same bytes as the
+/// reference. The bus is recovered after a trial that fails other than by
+/// a NACK. The fastest rate that passed is put in the speed table, for the
+/// probe's bus. Retries are turned off, and the statistics paused, while it
+/// runs. Software busses run at their own clock and only get the reference
+/// @param probe, Transfer Descriptor to test with, eg a register read. Its
+/// read must not change between reads, and be at most I2C_CALIB_READ_MAX
+/// bytes. With nothing to read it is an address-only ping
+/// @param trials, attempts needed at a rate, all without error. 0 counts as 1
+/// @return uint32_t, the rate found in Hz. The bus clock if nothing faster
+/// held up, 0 if the device did not respond at the bus clock
+uint32_t i2c_calibrate(i2c_xfer_t *probe, const uint8_t trials);
+
+/// @brief Runs i2c_calibrate() with an address-only ping for every device
+/// found by the last i2c_scan(). A ping only proves the address byte, use
+/// i2c_calibrate() with a register read where a device has one
+/// @param trials, attempts needed at a rate, all without error
+/// @return uint8_t, number of devices given a rate above the bus clock
+uint8_t i2c_calibrate_all(const uint8_t trials);
+#endif
+
+#ifdef I2C_USE_PEC
+/// @brief Works out the SMBus PEC (CRC-8, polynomial 0x07) of a buffer, in
+/// software. Used by software busses, and to check data from elsewhere
+/// @param crc, CRC so far, 0 to start a new one
+/// @param buf, bytes to add
+/// @param len, number of bytes
+/// @return uint8_t, the CRC including [buf]
+uint8_t i2c_crc8(uint8_t crc, const uint8_t *buf, const uint16_t len);
+#endif
+
+#ifdef I2C_USE_COALESCE
+/// @brief Writes [len] bytes from [buf] to the [reg] of [addr], through the
+/// write-combining buffer. The bytes are copied, and merged with what is
+/// pending if it is for the same device and the registers touch or overlap
+/// it, the newest value of a register winning. Only use it for devices that
+/// auto-increment the register address and whose registers have no side
+/// effects on write. The buffer holds one device on the current bus, any
+/// other transfer to that device, i2c_submit() included, flushes it first.
+/// Not for use from Interrupt handlers
+/// @param addr, Address of the I2C Device to Write to, MUST BE 7 Bit
+/// @param reg, first register to write
+/// @param buf, Buffer to write from
+/// @param len, number of bytes to write
+/// @return i2c_err_t. I2C_OK On Success. Errors come from whichever merged
+/// write had to be flushed, which may be an earlier one. A merged write sent
+/// ahead of another transfer to the device keeps its error for the next
+/// i2c_write_coalesce() or i2c_coalesce_flush(), so none are lost
+i2c_err_t i2c_write_coalesce(const uint8_t addr, const uint8_t reg,
+                             const uint8_t *buf, const uint16_t len);
+
+/// @brief Sends the pending merged write, if there is one
+/// @param None
+/// @return i2c_err_t. I2C_OK On Success, or when nothing is pending and no
+/// earlier merged write has failed unreported
+i2c_err_t i2c_coalesce_flush(void);
+
+/// @brief Sends the pending merged write only if its window has run out.
+/// Call it from the main loop, so writes are not held back after a burst
+/// @param None
+/// @return i2c_err_t. I2C_OK On Success, or when nothing is due
+i2c_err_t i2c_coalesce_poll(void);
+
+/// @brief Gets how well writes are being merged
+/// @param xfers, set to the number of transfers sent for them. Can be NULL
+/// @return uint32_t, the number of writes made with i2c_write_coalesce()
+uint32_t i2c_coalesce_stats(uint32_t *xfers);
+#endif
+
+#ifdef I2C_USE_WFI
+/// @brief Gets how long the CPU has slept in WFI, waiting on the bus. Runs
+/// freely, take the difference of two calls to time a piece of work
+/// @param None
+/// @return uint32_t, SysTick ticks spent asleep
+uint32_t i2c_sleep_ticks(void);
+#endif
+
+#ifdef I2C_USE_STATS
+/// @brief Gets the statistics kept for an address. Scans are not counted
+/// @param addr, I2C Device Address, or I2C_STATS_OTHER for the overflow slot
+/// @return const i2c_stats_t *, NULL if the address has no slot
+const i2c_stats_t *i2c_stats_get(const uint8_t addr);
+
+/// @brief Clears all statistics, and frees every slot
+/// @param None
+/// @return None
+void i2c_stats_reset(void);
+
+/// @brief Prints the statistics of every used slot with printf
+/// @param None
+/// @return None
+void i2c_stats_print(void);
+#else
+// Statistics compile out to nothing
+#define i2c_stats_reset()
+#define i2c_stats_print()
+#endif
+
+
+/*** Shims *******************************************************************/
+/// @brief Pings a specific I2C Address, and returns a i2c_err_t status
+/// @param addr I2C Device Address, MUST BE 7 Bit
+/// @return i2c_err_t, I2C_OK if the device responds
+static inline i2c_err_t i2c_ping(const uint8_t addr)
+{
+	i2c_xfer_t xfer = {.addr = addr};
+	return i2c_xfer(&xfer);
+}
+
 /// @brief reads [len] bytes from [addr]s [reg] register into [buf]
 /// @param addr, address of I2C Device to Read from, MUST BE 7 Bit
 /// @param buf, buffer to read to
 /// @param len, number of bytes to read
 /// @return 12c_err_t. I2C_OK on Success
-i2c_err_t i2c_read(const uint8_t addr,	const uint8_t reg,
+static inline i2c_err_t i2c_read(const uint8_t addr,	const uint8_t reg,
 										uint8_t *buf,
-										const uint8_t len);
+										const uint16_t len)
+{
+	i2c_xfer_t xfer = {.addr = addr, .reg_len = 1, .reg = {reg},
+	                   .rbuf = buf, .rlen = len};
+	return i2c_xfer(&xfer);
+}
 
 /// @brief writes [len] bytes from [buf], to the [reg] of [addr]
 /// @param addr, Address of the I2C Device to Write to, MUST BE 7 Bit
@@ -128,18 +738,42 @@ i2c_err_t i2c_read(const uint8_t addr,	const uint8_t reg,
 /// @param len, number of bytes to read
 /// @return i2c_err_t. I2C_OK On Success.
 /// There are no restrictions for reading data.
-i2c_err_t i2c_read_2ba(const uint8_t addr,	const uint8_t reglow, const uint8_t reghi,
+static inline i2c_err_t i2c_read_2ba(const uint8_t addr,	const uint8_t reglow, const uint8_t reghi,
 											uint8_t *buf,
-											const uint8_t len);
+											const uint16_t len)
+{
+	i2c_xfer_t xfer = {.addr = addr, .reg_len = 2, .reg = {reghi, reglow},
+	                   .rbuf = buf, .rlen = len};
+	return i2c_xfer(&xfer);
+}
 
 /// @brief writes [len] bytes from [buf], to the [reg] of [addr]
 /// @param addr, Address of the I2C Device to Write to, MUST BE 7 Bit
 /// @param buf, Buffer to write from
 /// @param len, number of bytes to read
 /// @return i2c_err_t. I2C_OK On Success.
-i2c_err_t i2c_write(const uint8_t addr,	const uint8_t reg,
+static inline i2c_err_t i2c_write(const uint8_t addr,	const uint8_t reg,
 										const uint8_t *buf,
-										const uint8_t len);
+										const uint16_t len)
+{
+	i2c_xfer_t xfer = {.addr = addr, .reg_len = 1, .reg = {reg},
+	                   .wbuf = buf, .wlen = len};
+	return i2c_xfer(&xfer);
+}
+
+/// @brief writes [iovcnt] segments from [iov] to [addr], back to back in
+/// one transfer. Each segment is sent straight from its own buffer, so a
+/// header and a payload need no staging copy
+/// @param addr, Address of the I2C Device to Write to, MUST BE 7 Bit
+/// @param iov, array of segments to write, in order
+/// @param iovcnt, number of segments
+/// @return i2c_err_t. I2C_OK On Success.
+static inline i2c_err_t i2c_writev(const uint8_t addr, const i2c_iovec_t *iov,
+                                   const uint8_t iovcnt)
+{
+	i2c_xfer_t xfer = {.addr = addr, .wvec = iov, .wvec_len = iovcnt};
+	return i2c_xfer(&xfer);
+}
 
 /// @brief writes [len] bytes from [buf], to the [reg] of [addr]
 /// @param addr, Address of the I2C Device to Write to, MUST BE 7 Bit
@@ -151,7 +785,12 @@ i2c_err_t i2c_write(const uint8_t addr,	const uint8_t reg,
 /// Writes should occur in max 64byte blocks, and to do that requires starting at
 ///  0x0 or a 64byte multiple.  The 24LCxxx eeprom processor will stop writing at
 ///  any 64byte boundary even if more data is left to write.  Some eeproms 'wrap'.
-i2c_err_t i2c_write_2ba(const uint8_t addr,	const uint8_t reglow, const uint8_t reghi, const uint8_t *buf,
-										const uint8_t len);
+static inline i2c_err_t i2c_write_2ba(const uint8_t addr,	const uint8_t reglow, const uint8_t reghi, const uint8_t *buf,
+										const uint16_t len)
+{
+	i2c_xfer_t xfer = {.addr = addr, .reg_len = 2, .reg = {reghi, reglow},
+	                   .wbuf = buf, .wlen = len};
+	return i2c_xfer(&xfer);
+}
 
 #endif
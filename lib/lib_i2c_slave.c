@@ -0,0 +1,301 @@
+/******************************************************************************
+* I2C Slave Mode for the CH32V003, companion to lib_i2c.
+* See lib_i2c_slave.h for more information.
+*
+* Released under the MIT Licence
+* Copyright ADBeta (c) 2024 - 2025
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+* DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+* OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+* USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+#include "lib_i2c_slave.h"
+#include <stddef.h>
+
+/*** Static Variables ********************************************************/
+static const i2c_slave_t *i2c_slave;
+static i2c_slave_stats_t  i2c_slave_st;
+
+// Register pointer, where the next read or write goes
+static uint16_t i2c_slave_ptr;
+
+// Master write state. The first byte is the register pointer
+static uint8_t  i2c_slave_got_ptr;
+static uint16_t i2c_slave_wfirst, i2c_slave_wlen;
+
+// Number of registers handed to DMA for the running read, 0 = no DMA
+static uint16_t i2c_slave_dma_len;
+
+
+/*** Static Functions ********************************************************/
+/// @brief Moves a register index on by [n], wrapping at the end of the file
+/// @param reg register index
+/// @param n number of registers to move on by
+/// @return uint16_t new register index
+__attribute__((always_inline))
+static inline uint16_t i2c_slave_wrap(const uint16_t reg, const uint16_t n)
+{
+	uint16_t next = reg + n;
+	return (next >= i2c_slave->size) ? next - i2c_slave->size : next;
+}
+
+/// @brief Gets the next register for the Master to read, and moves the
+/// pointer on. Write-only registers read as 0x00
+/// @param None
+/// @return uint8_t register value
+__attribute__((always_inline))
+static inline uint8_t i2c_slave_next_byte(void)
+{
+	uint16_t reg = i2c_slave_ptr;
+	i2c_slave_ptr = i2c_slave_wrap(reg, 1);
+	return I2C_SLAVE_MASKED(i2c_slave->wo_mask, reg) ? 0x00 : i2c_slave->regs[reg];
+}
+
+/// @brief Checks whether any register in a range is write-only
+/// @param reg first register
+/// @param len number of registers, must not run past the end of the file
+/// @return uint8_t 1 if any are write-only
+static uint8_t i2c_slave_any_wo(const uint16_t reg, const uint16_t len)
+{
+	if(i2c_slave->wo_mask == NULL) return 0;
+	for(uint16_t r = reg; r < reg + len; r++)
+		if(I2C_SLAVE_MASKED(i2c_slave->wo_mask, r)) return 1;
+	return 0;
+}
+
+/// @brief Stops a DMA fed read, and turns the I2C DMA request off
+/// @param None
+/// @return None
+static void i2c_slave_dma_stop(void)
+{
+	I2C1->CTLR2 &= ~I2C_CTLR2_DMAEN;
+	DMA1_Channel6->CFGR &= ~DMA_CFGR1_EN;
+	DMA1->INTFCR = DMA_CGIF6;
+}
+
+/// @brief Feeds the rest of a read after the first byte. Long runs of
+/// readable registers up to the end of the file go to DMA, anything else is
+/// fed by the TXE Interrupt
+/// @param None
+/// @return None
+static void i2c_slave_tx_rest(void)
+{
+	uint16_t left = i2c_slave->size - i2c_slave_ptr;
+	if(left >= I2C_SLAVE_DMA_THRESHOLD && !i2c_slave_any_wo(i2c_slave_ptr, left))
+	{
+		DMA1_Channel6->MADDR = (uint32_t)&i2c_slave->regs[i2c_slave_ptr];
+		DMA1_Channel6->CNTR  = left;
+		DMA1_Channel6->CFGR |= DMA_CFGR1_EN;
+		I2C1->CTLR2 |= I2C_CTLR2_DMAEN;
+
+		// The pointer is moved on as if all of it is read, the end of the
+		// read puts back whatever was not
+		i2c_slave_dma_len = left;
+		i2c_slave_ptr = 0;
+		i2c_slave_st.dma_reads++;
+		return;
+	}
+
+	I2C1->CTLR2 |= I2C_CTLR2_ITBUFEN;
+}
+
+/// @brief Ends a read once the Master NACKs. Puts the register pointer
+/// back past the last byte the Master really got
+/// @param None
+/// @return None
+static void i2c_slave_read_done(void)
+{
+	uint16_t unsent = 0;
+	if(i2c_slave_dma_len)
+	{
+		unsent = DMA1_Channel6->CNTR;
+		i2c_slave_dma_stop();
+		i2c_slave_dma_len = 0;
+	}
+	I2C1->CTLR2 &= ~I2C_CTLR2_ITBUFEN;
+
+	// A byte loaded but never clocked out is still in DATAR. Toggle the
+	// Peripheral so it is not sent at the start of the next read
+	if(!(I2C1->STAR1 & I2C_STAR1_TXE))
+	{
+		unsent++;
+		I2C1->CTLR1 &= ~I2C_CTLR1_PE;
+		I2C1->CTLR1 |= I2C_CTLR1_PE;
+		I2C1->CTLR1 |= I2C_CTLR1_ACK;
+	}
+
+	i2c_slave_ptr = i2c_slave_wrap(i2c_slave_ptr, i2c_slave->size - (unsent % i2c_slave->size));
+}
+
+/// @brief Ends a write once the Master sends a STOP, and reports it
+/// @param None
+/// @return None
+static void i2c_slave_write_done(void)
+{
+	I2C1->CTLR2 &= ~I2C_CTLR2_ITBUFEN;
+	if(i2c_slave_wlen && i2c_slave->on_change != NULL)
+		i2c_slave->on_change(i2c_slave_wfirst, i2c_slave_wlen);
+}
+
+
+/*** Interrupt Handlers ******************************************************/
+void I2C1_EV_IRQHandler(void) __attribute__((interrupt));
+void I2C1_EV_IRQHandler(void)
+{
+	uint32_t entry = SysTick->CNT;
+	uint16_t star1 = I2C1->STAR1;
+
+	// Address matched. Reading STAR2 after STAR1 clears ADDR
+	if(star1 & I2C_STAR1_ADDR)
+	{
+		if(I2C1->STAR2 & I2C_STAR2_TRA)
+		{
+			// Master read. SCL is stretched until the first byte is loaded,
+			// so it goes straight in before anything else is worked out
+			I2C1->DATAR = i2c_slave_next_byte();
+
+			uint32_t latency = SysTick->CNT - entry;
+			i2c_slave_st.latency_last = latency;
+			if(latency > i2c_slave_st.latency_max) i2c_slave_st.latency_max = latency;
+			i2c_slave_st.reads++;
+
+			i2c_slave_tx_rest();
+		} else {
+			// Master write, the first byte is the register pointer
+			i2c_slave_got_ptr = 0;
+			i2c_slave_wlen = 0;
+			i2c_slave_st.writes++;
+			I2C1->CTLR2 |= I2C_CTLR2_ITBUFEN;
+		}
+		return;
+	}
+
+	// Byte from the Master
+	if(star1 & I2C_STAR1_RXNE)
+	{
+		uint8_t data = I2C1->DATAR;
+		if(!i2c_slave_got_ptr)
+		{
+			i2c_slave_ptr = (data < i2c_slave->size) ? data : 0;
+			i2c_slave_wfirst = i2c_slave_ptr;
+			i2c_slave_got_ptr = 1;
+		} else {
+			// Read-only registers are skipped, the pointer still moves on
+			if(!I2C_SLAVE_MASKED(i2c_slave->ro_mask, i2c_slave_ptr))
+				i2c_slave->regs[i2c_slave_ptr] = data;
+			i2c_slave_ptr = i2c_slave_wrap(i2c_slave_ptr, 1);
+			i2c_slave_wlen++;
+		}
+	}
+
+	// Room for the next byte of a read not fed by DMA
+	if((star1 & I2C_STAR1_TXE) && (I2C1->CTLR2 & I2C_CTLR2_ITBUFEN) && !i2c_slave_dma_len)
+		I2C1->DATAR = i2c_slave_next_byte();
+
+	// End of a Master write. Reading STAR1 then writing CTLR1 clears STOPF
+	if(star1 & I2C_STAR1_STOPF)
+	{
+		I2C1->CTLR1 |= I2C_CTLR1_ACK;
+		i2c_slave_write_done();
+	}
+}
+
+
+void I2C1_ER_IRQHandler(void) __attribute__((interrupt));
+void I2C1_ER_IRQHandler(void)
+{
+	uint16_t star1 = I2C1->STAR1;
+
+	// A NACK from the Master is the normal end of a read
+	if(star1 & I2C_STAR1_AF)
+	{
+		I2C1->STAR1 &= ~I2C_STAR1_AF;
+		i2c_slave_read_done();
+	}
+
+	if(star1 & (I2C_STAR1_BERR | I2C_STAR1_ARLO | I2C_STAR1_OVR))
+	{
+		I2C1->STAR1 &= ~(I2C_STAR1_BERR | I2C_STAR1_ARLO | I2C_STAR1_OVR);
+		i2c_slave_st.errors++;
+		if(i2c_slave_dma_len) {i2c_slave_dma_stop(); i2c_slave_dma_len = 0;}
+		I2C1->CTLR2 &= ~I2C_CTLR2_ITBUFEN;
+	}
+}
+
+
+void DMA1_Channel6_IRQHandler(void) __attribute__((interrupt));
+void DMA1_Channel6_IRQHandler(void)
+{
+	// DMA reached the end of the file but the Master is still reading.
+	// Hand over to the TXE Interrupt, which wraps to register 0
+	i2c_slave_dma_stop();
+	i2c_slave_dma_len = 0;
+	I2C1->CTLR2 |= I2C_CTLR2_ITBUFEN;
+}
+
+
+/*** API Functions ***********************************************************/
+i2c_err_t i2c_slave_init(const i2c_slave_t *slave)
+{
+	i2c_slave = slave;
+	i2c_slave_ptr = 0;
+	i2c_slave_dma_len = 0;
+
+	// Toggle the I2C Reset bit to init Registers
+	RCC->APB1PRSTR |=  RCC_APB1Periph_I2C1;
+	RCC->APB1PRSTR &= ~RCC_APB1Periph_I2C1;
+
+	// Enable the I2C Peripheral, its Port, AFIO and the DMA Controller
+	RCC->APB1PCENR |= RCC_APB1Periph_I2C1;
+	RCC->APB2PCENR |= I2C_PORT_RCC | RCC_APB2Periph_AFIO;
+	RCC->AHBPCENR  |= RCC_AHBPeriph_DMA1;
+
+	// Reset the AFIO_PCFR1 register, then set it up
+	AFIO->PCFR1 &= ~(0x04400002);
+	AFIO->PCFR1 |= I2C_AFIO_REG;
+
+	// Clear, then set the GPIO Settings for SCL and SDA, on the selected port
+	I2C_PORT->CFGLR &= ~(0x0F << (4 * I2C_PIN_SDA));
+	I2C_PORT->CFGLR |= (GPIO_Speed_10MHz | GPIO_CNF_OUT_OD_AF) << (4 * I2C_PIN_SDA);
+	I2C_PORT->CFGLR &= ~(0x0F << (4 * I2C_PIN_SCL));
+	I2C_PORT->CFGLR |= (GPIO_Speed_10MHz | GPIO_CNF_OUT_OD_AF) << (4 * I2C_PIN_SCL);
+
+	// Set the Prerate frequency, and the 7 Bit Address
+	I2C1->CTLR2 = (FUNCONF_SYSTEM_CORE_CLOCK / I2C_PRERATE) & I2C_CTLR2_FREQ;
+	I2C1->OADDR1 = (slave->addr << 1) & I2C_OADDR1_ADD1_7;
+
+	// DMA1 Channel 6 feeds reads, Memory -> DATAR
+	DMA1_Channel6->PADDR = (uint32_t)&I2C1->DATAR;
+	DMA1_Channel6->CFGR  = DMA_CFGR1_DIR | DMA_CFGR1_MINC | DMA_CFGR1_TCIE;
+
+	// Event and Error Interrupts stay on, the Buffer Interrupt is per transfer
+	I2C1->CTLR2 |= I2C_CTLR2_ITEVTEN | I2C_CTLR2_ITERREN;
+	NVIC_EnableIRQ(I2C1_EV_IRQn);
+	NVIC_EnableIRQ(I2C1_ER_IRQn);
+	NVIC_EnableIRQ(DMA1_Channel6_IRQn);
+
+	// ACK can only be set once the Peripheral is enabled
+	I2C1->CTLR1 |= I2C_CTLR1_PE;
+	I2C1->CTLR1 |= I2C_CTLR1_ACK;
+
+	return I2C_OK;
+}
+
+
+const i2c_slave_stats_t *i2c_slave_stats(void)
+{
+	return &i2c_slave_st;
+}
@@ -0,0 +1,86 @@
+/******************************************************************************
+* I2C Slave Mode for the CH32V003, companion to lib_i2c.
+*
+* Exposes a register file to an external I2C Master, the same way most I2C
+* sensors do. The first byte of a write sets the register pointer, every
+* byte after it is written to the register file. Reads start at the register
+* pointer. The pointer auto-increments, and wraps at the end of the file.
+*
+* Uses the I2C_PINOUT_* selection from lib_i2c.h. The Slave owns I2C1 and
+* its Interrupts, so it can not be used together with lib_i2c on the same
+* board, only one of lib_i2c.c and lib_i2c_slave.c should be built.
+*
+* Released under the MIT Licence
+* Copyright ADBeta (c) 2024 - 2025
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+* DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+* OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+* USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+#ifndef CH32_LIB_I2C_SLAVE_H
+#define CH32_LIB_I2C_SLAVE_H
+
+#include "lib_i2c.h"
+
+/*** Settings ****************************************************************/
+// Reads with at least this many registers left before the end of the file
+// are fed by DMA1 Channel 6, shorter ones by the TXE Interrupt
+#ifndef I2C_SLAVE_DMA_THRESHOLD
+#define I2C_SLAVE_DMA_THRESHOLD 4
+#endif
+
+// Tests a register in a region mask, 1 bit per register, LSB first
+#define I2C_SLAVE_MASKED(mask, reg) \
+	((mask) != NULL && ((mask)[(reg) >> 3] & (1 << ((reg) & 0x07))))
+
+// Slave Configuration
+typedef struct {
+	uint8_t        addr;      // 7 Bit Address to answer to
+	uint8_t       *regs;      // Register file
+	uint16_t       size;      // Number of registers, 1 - 256
+	const uint8_t *ro_mask;   // Set bits are read-only to the Master. NULL = none
+	const uint8_t *wo_mask;   // Set bits are write-only, they read as 0x00
+	// Called from the Interrupt once a Master write has finished, with the
+	// first register written and the number of registers. Can be NULL
+	void (*on_change)(const uint8_t first, const uint16_t len);
+} i2c_slave_t;
+
+// Slave Statistics. Latency is counted in SysTick ticks, from the address
+// match Interrupt being entered to the first byte of a read being loaded.
+// The fixed Interrupt entry time of the core comes on top of it
+typedef struct {
+	uint32_t reads;           // Master reads served
+	uint32_t writes;          // Master writes received
+	uint32_t dma_reads;       // Reads fed by DMA
+	uint16_t errors;          // Bus errors and overruns
+	uint32_t latency_last;
+	uint32_t latency_max;
+} i2c_slave_stats_t;
+
+
+/*** Functions ***************************************************************/
+/// @brief Initialise I2C1 as a Slave, serving the register file in [slave].
+/// Enables the I2C and DMA1 Channel 6 Interrupts
+/// @param slave, Slave Configuration. Must stay valid while the Slave runs
+/// @return i2c_err_t, I2C_OK On success
+i2c_err_t i2c_slave_init(const i2c_slave_t *slave);
+
+/// @brief Gets the Statistics of the Slave
+/// @param None
+/// @return const i2c_slave_stats_t *
+const i2c_slave_stats_t *i2c_slave_stats(void);
+
+#endif
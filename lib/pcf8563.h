@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include "lib_i2c.h"
+#include "i2c_regcache.h"
 
 /* The 7 bit addr for pcf8563 rtc 
    The i2c lib auto adds the last 0 or 1 bit for read or write */
@@ -43,6 +44,7 @@
 #define RTCC_DAY_ADDR 			0x05
 #define RTCC_ALRM_MIN_ADDR 	    0x09
 #define RTCC_SQW_ADDR 	        0x0D
+#define RTCC_NUM_REGS           16
 
 /* Setting the alarm flag to 0 enables the alarm.
    Set it to 1 to disable the alarm for that value. */
@@ -92,6 +94,12 @@ char strDate[11];
 /* global error status from i2c lib */
 i2c_err_t err;
 
+/* Shadow of the 16 rtc registers. status1, the alarms, CLK_OUT and the
+   timer control only change when written, so they are served from RAM.
+   status2 (alarm and timer flags), the time and the timer count are set
+   by the rtc itself, and are always read */
+I2C_REGCACHE(rtcc_regs, RTCC_ADDR, RTCC_STAT1_ADDR, RTCC_NUM_REGS, 0x7E01, 0x0000);
+
 /* Pcf8563 uses binary coded decimal for the registers
    see the datasheet  */
 
@@ -122,7 +130,7 @@ uint8_t pcf8563_init(void)
     /* buffer legend */
     /* status1, status2, secs, min, hr, day, weekday, month, year, alm_min, alm_hr, alm_day, alm_wkday, clkout, timer_ctl, timer*/
 	const uint8_t buf[]={0x0,0x0,0x0,0x0,0x12,0x01,0x06,0x01,0x25,0x80,0x80,0x80,0x80,0x0,0x0};
-	return i2c_write(RTCC_ADDR,RTCC_STAT1_ADDR,buf,15);
+	return i2c_rc_write(&rtcc_regs,RTCC_STAT1_ADDR,buf,15);
 }
 
 /* Clear both status registers */
@@ -143,7 +151,7 @@ uint8_t pcf8563_get_time()
 {
 	uint8_t buf[5]={0,0,0,0,0};
 	err=0;
-	err = i2c_read(RTCC_ADDR,RTCC_STAT1_ADDR,buf, 5);
+	err = i2c_rc_read(&rtcc_regs,RTCC_STAT1_ADDR,buf, 5);
 	if (err == 0){
 		status1=buf[0];
 		status2=buf[1];
@@ -162,7 +170,7 @@ void pcf8563_get_date()
 {
 	uint8_t buf[4]={0,0,0,0};
 	err=0;
-	err = i2c_read(RTCC_ADDR,RTCC_DAY_ADDR,buf, 4);
+	err = i2c_rc_read(&rtcc_regs,RTCC_DAY_ADDR,buf, 4);
 	 /* 0x3f = 0b00111111 */
     day = bcdToDec(buf[0] & 0x3f);
     /* 0x07 = 0b00000111 */
@@ -294,12 +302,24 @@ uint8_t pcf8563_set_squarewave(uint8_t frequency)
         frequency == SQW_32HZ || frequency == SQW_32KHZ ||
         frequency == SQW_DISABLE)
     {
-        const uint8_t buf[1]={frequency};
-        return i2c_write(RTCC_ADDR,RTCC_SQW_ADDR,buf,1);
+        /* nothing is sent if CLK_OUT is already set this way */
+        return i2c_rc_update(&rtcc_regs,RTCC_SQW_ADDR,0xff,frequency);
     }
     return -1;
 }
 
+/* Change the [mask] bits of status2 to [bits], from a fresh read of the
+   register, so the alarm and timer flags the rtc has set since are kept.
+   returns i2c_err */
+uint8_t pcf8563_update_status2(uint8_t mask, uint8_t bits)
+{
+    err = i2c_rc_update(&rtcc_regs,RTCC_STAT2_ADDR,mask,bits);
+    if (err == 0){
+        status2 = rtcc_regs.shadow[RTCC_STAT2_ADDR];
+    }
+    return err;
+}
+
 /* Enable alarm interrupt
  * Whenever the clock matches these values an int will
  * be sent out pin 3 of the Pcf8563 chip
@@ -307,13 +327,8 @@ uint8_t pcf8563_set_squarewave(uint8_t frequency)
  */
 uint8_t pcf8563_enable_alarm()
 {
-    //set status2 AF val to zero
-    status2 &= ~RTCC_ALARM_AF;
-    //enable the interrupt
-    status2 |= RTCC_ALARM_AIE;
-
-    const uint8_t buf[]={status2};
-    return i2c_write(RTCC_ADDR,RTCC_STAT2_ADDR,buf,1);
+    //set status2 AF val to zero, and enable the interrupt
+    return pcf8563_update_status2(RTCC_ALARM_AF | RTCC_ALARM_AIE, RTCC_ALARM_AIE);
 }
 
 /* Check if the alarm is enabled
@@ -362,18 +377,19 @@ uint8_t pcf8563_set_alarm(uint8_t alarm_minute, uint8_t alarm_hour, uint8_t alar
 
     if ( (err=pcf8563_enable_alarm())==0){
         const uint8_t buf[4]={alarm_minute,alarm_hour,alarm_day,alarm_weekday};
-        err= i2c_write(RTCC_ADDR,RTCC_ALRM_MIN_ADDR,buf,4);
+        err= i2c_rc_write(&rtcc_regs,RTCC_ALRM_MIN_ADDR,buf,4);
     }
     return err;
 
 }
 
-/* Get alarm, set values to RTCC_NO_ALARM (99) if alarm flag is not set */
+/* Get alarm, set values to RTCC_NO_ALARM (99) if alarm flag is not set.
+   Served from the register cache once the alarm has been set or read */
 uint8_t pcf8563_get_alarm()
 {
     uint8_t buf[4]={0,0,0,0};
 	err=0;
-	err = i2c_read(RTCC_ADDR,RTCC_ALRM_MIN_ADDR,buf, 4);
+	err = i2c_rc_read(&rtcc_regs,RTCC_ALRM_MIN_ADDR,buf, 4);
 	if (err == 0){
         if(0b10000000 & buf[0]){
             alarm_minute = RTCC_NO_ALARM;
@@ -409,20 +425,13 @@ void pcf8563_format_alarm()
 uint8_t pcf8563_reset_alarm()
 {
     /* set status2 AF val to zero to reset alarm */
-    status2 &= ~RTCC_ALARM_AF;
-    const uint8_t buf[1]={status2};
-    return i2c_write(RTCC_ADDR,RTCC_STAT2_ADDR,buf,1);
+    return pcf8563_update_status2(RTCC_ALARM_AF, 0);
 }
 
 /* Clear the alarm and interrupt settings */
 uint8_t pcf8563_clear_alarm()
 {
-    /* set status2 AF val to zero to reset alarm */
-    status2 &= ~RTCC_ALARM_AF;
-    /* turn off the interrupt */
-    status2 &= ~RTCC_ALARM_AIE;
-
-    const uint8_t buf[1]={status2};
-    return i2c_write(RTCC_ADDR,RTCC_STAT2_ADDR,buf,1);
+    /* set status2 AF val to zero to reset alarm, and turn off the interrupt */
+    return pcf8563_update_status2(RTCC_ALARM_AF | RTCC_ALARM_AIE, 0);
 }
 #endif
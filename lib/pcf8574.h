@@ -75,6 +75,29 @@ uint8_t pcf8574_write_pins(){
     return i2c_write(I2C_ADDR,0x0,&pins,1);
 }
 
+/** @brief Write the pin settings when convenient.
+ *  With I2C_USE_COALESCE the write is held back, and a burst of lazy writes
+ *  goes out as one transfer of the last value, see pcf8574_flush().  Only
+ *  use it where the patterns in between do not matter, strobes (eg the E
+ *  pulse of an HD44780 backpack) must use pcf8574_write_pins().
+ */
+uint8_t pcf8574_write_pins_lazy(){
+#ifdef I2C_USE_COALESCE
+    return i2c_write_coalesce(I2C_ADDR,0x0,&pins,1);
+#else
+    return i2c_write(I2C_ADDR,0x0,&pins,1);
+#endif
+}
+
+/** @brief Make sure the last pin settings written have reached the device. */
+uint8_t pcf8574_flush(){
+#ifdef I2C_USE_COALESCE
+    return i2c_coalesce_flush();
+#else
+    return I2C_OK;
+#endif
+}
+
 /** @brief Read the pin states from the device. */
 uint8_t pcf8574_read_pins(){
     return i2c_read(I2C_ADDR,0x0,&pins,1);
@@ -52,8 +52,7 @@
  */
 uint8_t ssd1306_cmd(uint8_t cmd)
 {
-	ssd1306_pkt_send(&cmd, 1, 1);
-	return 0;
+	return ssd1306_pkt_send(&cmd, 1, 1);
 }
 
 /*
@@ -61,8 +60,7 @@ uint8_t ssd1306_cmd(uint8_t cmd)
  */
 uint8_t ssd1306_data(uint8_t *data, uint8_t sz)
 {
-	ssd1306_pkt_send(data, sz, 0);
-	return 0;
+	return ssd1306_pkt_send(data, sz, 0);
 }
 
 #define SSD1306_SETCONTRAST 0x81
@@ -248,6 +246,40 @@ void ssd1306_refresh(void)
 
 }
 
+/*
+ * Send the frame buffer a packet at a time, so a refresh can be spread over
+ * several calls with other work in between. Returns 1 while packets are
+ * left to send. Displays that need the whole frame at once are sent in one
+ * call
+ */
+uint8_t ssd1306_refresh_part(void)
+{
+#if defined(SSD1306_FULLUSE) && !defined(SH1107)
+	static uint16_t pos;
+
+	if(pos == 0)
+	{
+		ssd1306_cmd(SSD1306_COLUMNADDR);
+		ssd1306_cmd(SSD1306_OFFSET);   // Column start address (0 = reset)
+		ssd1306_cmd(SSD1306_OFFSET+SSD1306_W-1); // Column end address (127 = reset)
+
+		ssd1306_cmd(SSD1306_PAGEADDR);
+		ssd1306_cmd(0); // Page start address (0 = reset)
+		ssd1306_cmd(7); // Page end address
+	}
+
+	ssd1306_data(&ssd1306_buffer[pos], SSD1306_PSZ);
+	pos += SSD1306_PSZ;
+	if(pos < sizeof(ssd1306_buffer)) return 1;
+
+	pos = 0;
+	return 0;
+#else
+	ssd1306_refresh();
+	return 0;
+#endif
+}
+
 /*
  * plot a pixel in the buffer
  */
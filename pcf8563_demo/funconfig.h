@@ -3,5 +3,8 @@
 
 #define CH32V003           1
 
+/* The RTC runs at the 400KHz bus clock, the OLED at SSD1306_I2C_CLKRATE */
+#define I2C_USE_SPEEDS
+
 #endif
 
@@ -26,9 +26,73 @@
 #include "ssd1306_i2c.h"
 #include "ssd1306.h"
 #include "ch32v003_touch.h"
+#include "i2c_sched.h"
 
 uint32_t count;
 
+/* The main loop runs these jobs with i2c_sched_poll(), in place of a fixed
+   Delay_Ms.  Shorter periods get the bus first, the display refresh goes
+   out a packet at a time whenever nothing else is due */
+
+/* attach a probe wire to PC4, when you touch it, it should trigger this job */
+uint8_t touch_job(i2c_job_t *job)
+{
+	int iterations = 3;
+	uint32_t but = ReadTouchPin( GPIOC, 4, 2, iterations );
+	/* print but to the screen if it isnt working to see your cap touch raw values */
+	if (but>5500) { 
+		printf("cap button pressed\n"); 
+		pcf8563_format_alarm();  /*print alarm bytes*/
+		pcf8563_format_status(); /*print the status bytes*/
+		pcf8563_clear_alarm(); /*clear alarm, press the wire again to see cleared bytes*/
+		pcf8563_set_squarewave(SQW_1024HZ);	/*set the CLK_OUT to 1khz, attach a logic analyzer to verify*/
+	}
+	return 0;
+}
+
+/* status2 is read by the scheduler itself, this only looks at the AF flag */
+uint8_t alarm_job(i2c_job_t *job)
+{
+	if (job->xfer.err == I2C_OK && pcf8563_alarm_active()) {
+		printf("alarm went off\n");
+		pcf8563_reset_alarm(); /*clear AF, leave the interrupt on*/
+	}
+	return 0;
+}
+
+/* draw the time and date into the frame buffer */
+uint8_t clock_job(i2c_job_t *job)
+{
+	ssd1306_drawstr_sz(0,0, "[] Date Reminder", 1, fontsize_8x8);
+	ssd1306_drawstr_sz(0,20, pcf8563_format_time(RTCC_TIME_HMS), 1, fontsize_16x16);
+	ssd1306_drawstr_sz(0,48, pcf8563_format_date(RTCC_DATE_US), 1, fontsize_8x8);
+	return 0;
+}
+
+/* send the frame buffer, one packet per step */
+uint8_t display_job(i2c_job_t *job)
+{
+	return ssd1306_refresh_part();
+}
+
+/* print the deadline misses and jitter of every job */
+uint8_t stats_job(i2c_job_t *job)
+{
+	i2c_sched_print();
+	return 0;
+}
+
+i2c_job_t jobs[] = {
+	{.name = "touch",   .period_us = 50000,   .callback = touch_job},
+	{.name = "alarm",   .period_us = 100000,  .deadline_us = 5000, .callback = alarm_job,
+	 .xfer = {.addr = RTCC_ADDR, .reg_len = 1, .reg = {RTCC_STAT2_ADDR},
+	          .rbuf = &status2, .rlen = 1}},
+	{.name = "clock",   .period_us = 250000,  .callback = clock_job},
+	{.name = "display", .period_us = 250000,  .callback = display_job,
+	 .flags = I2C_JOB_BACKGROUND},
+	{.name = "stats",   .period_us = 10000000, .callback = stats_job},
+};
+
 /* I2C Scan Callback example function. Prints the address which responded */
 void i2c_scan_callback(const uint8_t addr)
 {
@@ -47,10 +111,11 @@ int main()
 	   I2C_CLK_500KHZ   I2C_CLK_600KHZ   I2C_CLK_750KHZ    I2C_CLK_1MHZ  */
 	if(i2c_init(I2C_CLK_400KHZ) != I2C_OK) printf("Failed to init the I2C Bus\n");
 
-	/* Initialising I2C causes the pins to transition from LOW to HIGH.
-	   Wait 100ms to allow the I2C Device to timeout and ignore the transition.
+	/* Initialising I2C causes the pins to transition from LOW to HIGH, and a
+	   device may have been reset halfway through a transfer.  Clock out any
+	   half sent byte and send a STOP, so every device starts from idle.
 	   Otherwise, an extra 1-bit will be added to the next transmission */
-	Delay_Ms(100);
+	if(i2c_recover() != I2C_OK) printf("I2C Bus is held low\n");
 
 	/* Scan the I2C Bus, prints any devices that respond */
 	printf("----Scanning I2C Bus for Devices---\n");
@@ -59,37 +124,25 @@ int main()
 
 	pcf8563_init();	
 	printf("Clock set...\n");
+	ssd1306_i2c_init();
 	ssd1306_init();
 	/* configure touch pins, enable GPIOC and ADC */
 	RCC->APB2PCENR |= RCC_APB2Periph_GPIOC | RCC_APB2Periph_ADC1;
 	InitTouchADC();
-	uint32_t but[4] = { 0 };
 
 	pcf8563_set_squarewave(SQW_DISABLE); /*disable the CLK_OUT test pin*/
 	/* test set alarm */
 	pcf8563_set_alarm(1,2,3,4);
 	pcf8563_get_alarm();
 	printf("Alarm enabled: 0x%02x, active: 0x%02x\n",pcf8563_alarm_enabled(), pcf8563_alarm_active());
+	/* the alarm was read back from the register cache, not the rtc */
+	printf("Register cache: %u hits, %u misses\n", rtcc_regs.hits, rtcc_regs.misses);
+
+	for(uint8_t k = 0; k < sizeof(jobs) / sizeof(jobs[0]); k++) i2c_sched_add(&jobs[k]);
 
 	while(1)
 	{
-		ssd1306_drawstr_sz(0,0, "[] Date Reminder", 1, fontsize_8x8);
-		ssd1306_drawstr_sz(0,20, pcf8563_format_time(RTCC_TIME_HMS), 1, fontsize_16x16);
-		ssd1306_drawstr_sz(0,48, pcf8563_format_date(RTCC_DATE_US), 1, fontsize_8x8);
-		ssd1306_refresh();			
-
-		int iterations = 3;
-		but[0] = ReadTouchPin( GPIOC, 4, 2, iterations );
-		/* attach a probe wire to PC4, when you touch it, it should trigger this section of code */
-		/* print but[0] to the screen if it isnt working to see your cap touch raw values */
-		if (but[0]>5500) { 
-			printf("cap button pressed\n"); 
-			pcf8563_format_alarm();  /*print alarm bytes*/
-			pcf8563_format_status(); /*print the status bytes*/
-			pcf8563_clear_alarm(); /*clear alarm, press the wire again to see cleared bytes*/
-			pcf8563_set_squarewave(SQW_1024HZ);	/*set the CLK_OUT to 1khz, attach a logic analyzer to verify*/
-		}
-		Delay_Ms(300); /*play with this to get decent second value prints to the display, can be 'jumpy' */
+		i2c_sched_poll();
 	}
 	return(0);
 }
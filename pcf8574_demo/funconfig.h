@@ -3,5 +3,11 @@
 
 #define CH32V003           1
 
+/* The PCF8574 is only rated for 100KHz, see i2c_set_speed() in main.c */
+#define I2C_USE_SPEEDS
+
+/* Merge bursts of lazy pin writes into one transfer, see burst() in main.c */
+#define I2C_USE_COALESCE
+
 #endif
 
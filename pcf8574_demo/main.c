@@ -78,6 +78,30 @@ void test(void){
     }
 }
 
+#ifdef I2C_USE_COALESCE
+/* Walk a pin up and down the port as fast as it can be written.  Only the
+   last pattern of the burst is sent, the rest are merged away */
+void burst(void){
+    int k;
+    uint32_t writes, xfers;
+    uint32_t w0 = i2c_coalesce_stats(&xfers);
+    uint32_t x0 = xfers;
+
+    for (k=0; k<8; k++){
+        pcf8574_clear_all_pins();
+        pcf8574_set_pin(k);
+        pcf8574_write_pins_lazy();
+    }
+    pcf8574_flush();
+
+    writes = i2c_coalesce_stats(&xfers) - w0;
+    printf("burst, %lu writes in %lu transfers\n", writes, xfers - x0);
+    pcf8574_read_pins();
+    printf("read, ");
+    print_bits(pins);
+}
+#endif
+
 
 /* Lets test out some features. */
 int main()
@@ -91,10 +115,14 @@ int main()
 	   I2C_CLK_500KHZ   I2C_CLK_600KHZ   I2C_CLK_750KHZ    I2C_CLK_1MHZ  */
 	if(i2c_init(I2C_CLK_400KHZ) != I2C_OK) printf("Failed to init the I2C Bus\n");
 
-	/* Initialising I2C causes the pins to transition from LOW to HIGH.
-	   Wait 100ms to allow the I2C Device to timeout and ignore the transition.
+	/* Initialising I2C causes the pins to transition from LOW to HIGH, and a
+	   device may have been reset halfway through a transfer.  Clock out any
+	   half sent byte and send a STOP, so every device starts from idle.
 	   Otherwise, an extra 1-bit will be added to the next transmission */
-	Delay_Ms(100);
+	if(i2c_recover() != I2C_OK) printf("I2C Bus is held low\n");
+
+	/* The PCF8574 is a 100KHz part, the rest of the bus can run faster */
+	i2c_set_speed(I2C_ADDR, I2C_CLK_100KHZ);
 
 	/* Scan the I2C Bus, prints any devices that respond */
 	printf("----Scanning I2C Bus for Devices---\n");
@@ -103,6 +131,9 @@ int main()
 
 	test();
 
+#ifdef I2C_USE_COALESCE
+	burst();
+#endif
 
 	return(0);
 }